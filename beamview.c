@@ -1,13 +1,35 @@
+#define _GNU_SOURCE
 #include <SDL2/SDL.h>
 #include <X11/Xlib.h>
 #include <cairo.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
 #include <glib.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+#include <inttypes.h>
 #include <limits.h>
 #include <math.h>
+#include <poll.h>
 #include <poppler.h>
+#include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+#include <sys/mman.h>
+#ifdef __linux__
+#include <sys/prctl.h>
+#endif
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 #include <unistd.h>
 
 #define die_on(cond, fmt, ...)                                                 \
@@ -20,44 +42,356 @@
 #define expect(x)                                                              \
     die_on(!(x), "!(%s) at %s:%s:%d\n", #x, __FILE__, __func__, __LINE__)
 
-static const int page_number_invalid = -1;
-#define CACHE_SIZE 3
+#define DEFAULT_CACHE_MB 1024
+#define DEFAULT_PREFETCH_AHEAD 4
+#define DEFAULT_PREFETCH_BEHIND 1
+// Turns closer together than this double how far ahead we prefetch
+#define FAST_TURN_MS 500
 #define NUM_CTX 2
+#define MAX_WORKERS 8
+#define INLINE_TILES 4
+// Enough for the previous, current and next pages, plus one to render into
+#define NUM_TEXTURES 4
+#define PREVIEW_FRACTION 0.25
+#define RESCALE_DEBOUNCE_MS 150
+#define DIRTY_MERGE_ROWS 16
+// Downscales at least this steep look as good as rendering afresh
+#define DOWNSCALE_SHARP_RATIO 0.5
+#define REFINE_PRIORITY 100
+#define NUM_AA_MODES 3
+// Drafts must take at most this fraction of a full render's time
+#define DRAFT_MAX_COST 0.75
+// Rough cost of each drawing operation kept in a recording, on top of images
+#define RECORD_OP_BYTES 256
+// Downscaling weights are fixed point with this many fractional bits
+#define BOX_SHIFT 14
+#define THUMB_FRACTION 0.2
+#define THUMB_PRIORITY 1000
+// Until compressed, evicted pages are in neither tier
+#define PACK_PRIORITY -2
+#define STORE_PRIORITY 500
+#define SLIDE_REGION 0
+#define PRESENTER_REGION (NUM_CTX - 1)
+// LaTeX builds tend to write the PDF several times
+#define RELOAD_SETTLE_MS 300
+// Fingerprints render the whole page this wide, so each region at half
+#define FINGERPRINT_WIDTH 1024
+// Render processes get their socket and the PDF at these fds. What we hand
+// them is first moved above FARM_FD_MIN, so setting them up can't clobber it.
+#define FARM_SOCK_FD 3
+#define FARM_DOC_FD 4
+#define FARM_FD_MIN 10
+#define RENDER_TIMEOUT_MS 10000
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0 // SO_NOSIGPIPE is set on the socket instead
+#endif
 #define BV_CTX "bv_ctx"
+#define DISK_CACHE_MAGIC "BVC1"
+#define DISK_CACHE_MAX_MB 2048
+// Log-linear like HdrHistogram, within 1/16, up to 2^HIST_MAGNITUDES us
+#define HIST_SUB_BITS 4
+#define HIST_SUB_BUCKETS (1 << HIST_SUB_BITS)
+#define HIST_MAGNITUDES 27
+#define HIST_BUCKETS ((HIST_MAGNITUDES - HIST_SUB_BITS + 1) * HIST_SUB_BUCKETS)
+
+static const int page_number_invalid = -1;
+static const double scale_any = -1;
+// Best first, see --render-budget-ms
+static const cairo_antialias_t antialias_modes[NUM_AA_MODES] = {
+    CAIRO_ANTIALIAS_BEST, CAIRO_ANTIALIAS_FAST, CAIRO_ANTIALIAS_NONE};
+static Uint32 render_done_event, latency_report_event, reload_event,
+    dedup_event;
 
+// While locked, the pool is rendering straight into its pixels
 struct bv_texture {
     SDL_Texture *texture;
     int natural_width, natural_height;
+    int page_number, locked, derived;
+    double scale;
 };
 
 struct bv_sdl_ctx {
     SDL_Window *window;
     SDL_Renderer *renderer;
-    struct bv_texture texture;
+    struct bv_texture textures[NUM_TEXTURES];
+    int front;
     int is_fullscreen;
     int region_index;
 };
 
+// Derived entries are previews, downscales or drafts, shown until a proper
+// render replaces them
 struct bv_cache_entry {
     cairo_surface_t *cairo_surface;
     int img_width, img_height;
     double page_width, page_height;
-    int page_number;
+    int page_number, region, derived;
+    double scale;
+    size_t bytes;
+    uint32_t *packed; // Instead of a surface, in the compressed tier
+    struct bv_cache_entry *prev, *next;
 };
 
-static struct bv_cache_entry *cache_slot(struct bv_cache_entry cache[],
-                                         int page) {
-    return &cache[page % CACHE_SIZE];
-}
+// Most recently used at the head. Evictions are compressed into spill.
+struct bv_page_cache {
+    struct bv_cache_entry *head, *tail;
+    size_t bytes, budget;
+    struct bv_page_cache *spill;
+    struct bv_render_pool *packer;
+};
+
+struct bv_config {
+    const char *pdf_file;
+    size_t cache_bytes, compress_bytes, record_bytes;
+    int bench, tiles, disk_cache, progressive, drop_uploaded, watch, preload;
+    int isolate, dedup, workers, render_budget_ms;
+    int prefetch_ahead, prefetch_behind;
+};
+
+// Followed by the raw ARGB32 rows, so files can be mapped as a surface
+struct bv_disk_header {
+    char magic[4];
+    uint32_t width, height, stride;
+};
+
+// Rows [0, next_row) have been handed out as bands. Jobs with a source,
+// unpack, pack or store do that instead of rendering, in one go. render_ms
+// only counts time when a band was being rendered.
+struct bv_render_job {
+    int page_index, region, priority, preview, thumbnail, pack, store;
+    cairo_antialias_t antialias;
+    double scale, render_ms, busy_since;
+    int busy;
+    cairo_surface_t *source;
+    uint32_t *unpack;
+    struct bv_cache_entry result;
+    struct bv_texture *target; // Set if result wraps locked texture pixels
+    int recache;               // Render a target's page again for the cache
+    int next_row, rows_done, cancelled, sync, done, failed;
+    struct bv_render_job *next;
+};
+
+// Also what's sent to a render process, along with the surface's memfd
+struct bv_band {
+    int page_index, region, thumbnail, y, rows;
+    int width, height, stride;
+    double scale;
+    cairo_antialias_t antialias;
+};
+
+// Recorded at the largest region's scale, and again if rendered larger.
+// surface is NULL while the page is still being recorded.
+struct bv_recording {
+    cairo_surface_t *surface;
+    int page_index;
+    double scale, page_width;
+    size_t bytes; // Estimated, see record_page()
+    struct bv_recording *next;
+};
+
+struct bv_render_worker {
+    SDL_Thread *thread;
+    PopplerDocument *document;
+    struct bv_render_pool *pool;
+    pid_t pid;
+    int sock;
+};
+
+struct bv_render_pool {
+    SDL_mutex *lock;
+    SDL_cond *cond, *done_cond;
+    SDL_cond *record_cond; // Signalled when a recording is finished
+    struct bv_render_job *jobs; // Queued and running, completed ones are
+                                // handed to the main thread via SDL events
+    struct bv_render_worker workers[MAX_WORKERS];
+    int num_workers, tiles, quit, isolate, remove_disk_cache;
+    char *disk_cache_dir, *uri;
+    GBytes *bytes;
+    int doc_fd; // A memfd with the PDF for render processes, or -1
+    struct bv_recording *recordings; // Most recently used first
+    size_t record_bytes, record_budget;
+    double record_scale; // The largest region scale, set by the main thread
+};
+
+struct bv_histogram {
+    uint64_t counts[HIST_BUCKETS];
+    uint64_t total, max_us;
+};
+
+// Keydown to full quality present, split by whether the page was ready
+struct bv_latency {
+    struct bv_histogram hit, miss;
+    double start_ms;
+    int is_hit, pending[NUM_CTX];
+};
+
+struct bv_prefetch {
+    int ahead, behind, direction, fast;
+    Uint32 last_turn;
+};
+
+// Thumbnails in grid order in one texture, so the grid is a single copy.
+// thumbs carries them over to the next version of the PDF.
+struct bv_overview {
+    SDL_Texture *atlas;
+    cairo_surface_t **thumbs; // Indexed by page, NULL until rendered
+    int cols, rows, cell_width, cell_height;
+    int active, selected;
+};
+
+struct bv_reload {
+    GBytes *bytes;
+    PopplerDocument *document;
+    int num_pages;
+    int *old_page; // For each page, the one with the same content in the
+                   // previous version, or page_number_invalid
+    int *alias;    // See alias_pages()
+};
+
+// Results for a stale generation are dropped
+struct bv_dedup {
+    char *uri;
+    GBytes *bytes;
+    int generation, num_pages;
+    int *alias;
+};
+
+// Owned by the watcher thread. fingerprints are those of the version the main
+// thread will have once it's processed every reload we've sent.
+struct bv_watcher {
+    char *path, *name;
+    int fd;
+    GBytes *bytes;
+    gchar **fingerprints;
+    int num_pages;
+};
+
+// Per region and antialias mode, or 0 if not rendered that way yet
+struct bv_render_cost {
+    double ms[NUM_CTX][NUM_AA_MODES];
+};
 
 struct bv_prog_state {
     struct bv_sdl_ctx ctx[NUM_CTX];
-    double current_scale;
+    double region_scale[NUM_CTX];
     PopplerDocument *document;
-    int current_page, num_pages, needs_redraw, needs_cache;
-    struct bv_cache_entry page_cache[CACHE_SIZE];
+    GBytes *bytes; // The PDF's contents, when watching it for changes
+    char *uri, *disk_cache_dir;
+    int current_page, num_pages, needs_redraw, needs_cache, progressive;
+    int drop_uploaded, rescale_pending;
+    Uint32 rescale_deadline;
+    struct bv_page_cache page_cache, cold_cache;
+    struct bv_render_pool *pool;
+    struct bv_latency latency;
+    struct bv_prefetch prefetch;
+    // Turns coalesced while draining events
+    int nav_pending, nav_target, nav_jump;
+    Uint32 nav_timestamp;
+    // typed_page is the 1-based page number being typed, or 0. back_page is
+    // where we were before the last jump.
+    int typed_page, back_page;
+    struct bv_overview overview;
+    // Renders of a page are kept under page_alias[page], NULL until known
+    int *page_alias;
+    int dedup, doc_generation;
+    struct bv_render_cost *render_cost; // Indexed by page
+    int render_budget_ms;
 };
 
+static double now_ms(void) {
+    return (double)SDL_GetPerformanceCounter() * 1000.0 /
+           (double)SDL_GetPerformanceFrequency();
+}
+
+static int histogram_index(uint64_t us) {
+    if (us < HIST_SUB_BUCKETS)
+        return (int)us;
+    if (us >= UINT64_C(1) << HIST_MAGNITUDES)
+        us = (UINT64_C(1) << HIST_MAGNITUDES) - 1;
+    int msb = 63 - __builtin_clzll(us);
+    int shift = msb - HIST_SUB_BITS;
+    return (shift + 1) * HIST_SUB_BUCKETS + (int)(us >> shift) -
+           HIST_SUB_BUCKETS;
+}
+
+// The highest value which lands in the bucket
+static uint64_t histogram_bucket_max(int idx) {
+    if (idx < HIST_SUB_BUCKETS)
+        return idx;
+    int shift = idx / HIST_SUB_BUCKETS - 1;
+    uint64_t low = (uint64_t)(HIST_SUB_BUCKETS + idx % HIST_SUB_BUCKETS)
+                   << shift;
+    return low + (UINT64_C(1) << shift) - 1;
+}
+
+static void histogram_record(struct bv_histogram *hist, double ms) {
+    uint64_t us = ms > 0 ? (uint64_t)(ms * 1000.0) : 0;
+    hist->counts[histogram_index(us)]++;
+    hist->total++;
+    if (us > hist->max_us)
+        hist->max_us = us;
+}
+
+static double histogram_percentile(const struct bv_histogram *hist,
+                                   double pct) {
+    uint64_t rank = (uint64_t)ceil(pct / 100.0 * hist->total), seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += hist->counts[i];
+        if (seen >= rank && seen > 0) {
+            uint64_t us = histogram_bucket_max(i);
+            return (us < hist->max_us ? us : hist->max_us) / 1000.0;
+        }
+    }
+    return 0;
+}
+
+static void histogram_print(const char *name,
+                            const struct bv_histogram *hist) {
+    fprintf(stderr,
+            "  %-4s %8" PRIu64 " turns  p50 %7.2f  p95 %7.2f  p99 %7.2f  "
+            "max %7.2f\n",
+            name, hist->total, histogram_percentile(hist, 50),
+            histogram_percentile(hist, 95), histogram_percentile(hist, 99),
+            hist->max_us / 1000.0);
+}
+
+static void latency_report(const struct bv_latency *latency) {
+    fprintf(stderr, "Page turn latency, keydown to present (ms):\n");
+    histogram_print("hit", &latency->hit);
+    histogram_print("miss", &latency->miss);
+}
+
+// key_timestamp only has millisecond resolution
+static void latency_start(struct bv_latency *latency, Uint32 key_timestamp,
+                          int is_hit) {
+    latency->start_ms = now_ms() - (double)(SDL_GetTicks() - key_timestamp);
+    latency->is_hit = is_hit;
+    for (int i = 0; i < NUM_CTX; i++)
+        latency->pending[i] = 1;
+}
+
+static void latency_presented(struct bv_latency *latency, int ctx_index) {
+    if (!latency->pending[ctx_index])
+        return;
+    latency->pending[ctx_index] = 0;
+    histogram_record(latency->is_hit ? &latency->hit : &latency->miss,
+                     now_ms() - latency->start_ms);
+}
+
+// SIGUSR1 is blocked in every thread, and waited for here, so that a report
+// can be requested without touching any state from a signal handler
+static int latency_signal_thread(void *data) {
+    const sigset_t *set = data;
+    for (;;) {
+        int sig;
+        if (sigwait(set, &sig) == 0) {
+            SDL_Event event = {.type = latency_report_event};
+            SDL_PushEvent(&event);
+        }
+    }
+    return 0;
+}
+
 static void toggle_fullscreen(struct bv_sdl_ctx *ctx) {
     SDL_SetWindowFullscreen(
         ctx->window, ctx->is_fullscreen ? 0 : SDL_WINDOW_FULLSCREEN_DESKTOP);
@@ -71,10 +405,15 @@ static void present_texture(SDL_Renderer *renderer, SDL_Texture *texture,
     int win_width, win_height;
     SDL_GetRendererOutputSize(renderer, &win_width, &win_height);
 
-    double scale = fmin((double)win_width / natural_width,
-                        (double)win_height / natural_height);
-    int new_width = (int)(natural_width * scale);
-    int new_height = (int)(natural_height * scale);
+    // Textures rendered for this window are drawn 1:1, only stale ones scaled
+    int new_width = natural_width, new_height = natural_height;
+    if (natural_width > win_width || natural_height > win_height ||
+        (win_width - natural_width > 1 && win_height - natural_height > 1)) {
+        double scale = fmin((double)win_width / natural_width,
+                            (double)win_height / natural_height);
+        new_width = (int)(natural_width * scale);
+        new_height = (int)(natural_height * scale);
+    }
 
     SDL_Rect dst = {(win_width - new_width) / 2, (win_height - new_height) / 2,
                     new_width, new_height};
@@ -85,80 +424,2461 @@ static void present_texture(SDL_Renderer *renderer, SDL_Texture *texture,
     SDL_RenderPresent(renderer);
 }
 
-static double compute_scale(struct bv_sdl_ctx ctx[], int num_ctx,
-                            double page_width, double page_height) {
+static double job_scale(double region_scale, int preview) {
+    return preview ? region_scale * PREVIEW_FRACTION : region_scale;
+}
+
+static double compute_scale(struct bv_sdl_ctx *ctx, double page_width,
+                            double page_height) {
     expect(page_width > 0 && page_height > 0);
-    double scale = 0;
-    for (int i = 0; i < num_ctx; i++) {
-        int win_width, win_height;
-        SDL_GetRendererOutputSize(ctx[i].renderer, &win_width, &win_height);
-        double scale_i = fmax((double)win_width / (page_width / num_ctx),
-                              (double)win_height / page_height);
-        scale = fmax(scale, scale_i);
-    }
-    return scale;
+    int win_width, win_height;
+    SDL_GetRendererOutputSize(ctx->renderer, &win_width, &win_height);
+    return fmin((double)win_width / (page_width / NUM_CTX),
+                (double)win_height / page_height);
 }
 
-static cairo_surface_t *
-render_page_to_cairo_surface(PopplerPage *page, double scale, int *img_width,
-                             int *img_height, double *page_width,
-                             double *page_height) {
-    poppler_page_get_size(page, page_width, page_height);
-    *img_width = (int)(*page_width * scale);
-    *img_height = (int)(*page_height * scale);
+static void region_surface_size(double page_width, double page_height,
+                                double scale, int *img_width,
+                                int *img_height) {
+    *img_width = (int)(page_width / NUM_CTX * scale);
+    *img_height = (int)(page_height * scale);
+}
 
-    cairo_surface_t *surface = cairo_image_surface_create(
-        CAIRO_FORMAT_ARGB32, *img_width, *img_height);
-    cairo_t *cr = cairo_create(surface);
+static cairo_surface_t *create_page_surface(int img_width, int img_height) {
+    cairo_surface_t *surface =
+        cairo_image_surface_create(CAIRO_FORMAT_ARGB32, img_width, img_height);
+    expect(cairo_surface_status(surface) == CAIRO_STATUS_SUCCESS);
+    return surface;
+}
+
+struct bv_shared_mapping {
+    void *addr;
+    size_t len;
+    int fd;
+};
+
+static const cairo_user_data_key_t shared_mapping_key;
+
+// Only used with --isolate, which parse_args() refuses elsewhere
+static int create_memfd(const char *name) {
+#ifdef __linux__
+    return memfd_create(name, MFD_CLOEXEC);
+#else
+    (void)name;
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+static void free_shared_mapping(void *data) {
+    struct bv_shared_mapping *mapping = data;
+    munmap(mapping->addr, mapping->len);
+    if (mapping->fd >= 0)
+        close(mapping->fd);
+    free(mapping);
+}
+
+static cairo_surface_t *create_shared_surface(int img_width, int img_height) {
+    int stride = cairo_format_stride_for_width(CAIRO_FORMAT_ARGB32, img_width);
+    size_t len = (size_t)stride * img_height;
+    int fd = create_memfd("bv_page");
+    expect(fd >= 0);
+    expect(ftruncate(fd, len) == 0);
+    void *addr =
+        mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    expect(addr != MAP_FAILED);
+
+    cairo_surface_t *surface = cairo_image_surface_create_for_data(
+        addr, CAIRO_FORMAT_ARGB32, img_width, img_height, stride);
+    expect(cairo_surface_status(surface) == CAIRO_STATUS_SUCCESS);
+    struct bv_shared_mapping *mapping = malloc(sizeof(*mapping));
+    expect(mapping);
+    *mapping = (struct bv_shared_mapping){addr, len, fd};
+    expect(cairo_surface_set_user_data(surface, &shared_mapping_key, mapping,
+                                       free_shared_mapping) ==
+           CAIRO_STATUS_SUCCESS);
+    return surface;
+}
+
+// Render processes are done with it, so only the mapping keeps it alive
+static void close_shared_fd(cairo_surface_t *surface) {
+    struct bv_shared_mapping *mapping =
+        cairo_surface_get_user_data(surface, &shared_mapping_key);
+    if (mapping && mapping->fd >= 0) {
+        close(mapping->fd);
+        mapping->fd = -1;
+    }
+}
+
+// Bands wrap the same buffer, translated into place, so they land on the
+// region's pixel grid and can be rendered concurrently
+static cairo_t *begin_band(cairo_surface_t *surface,
+                           cairo_antialias_t antialias, int y, int rows) {
+    int stride = cairo_image_surface_get_stride(surface);
+    unsigned char *data = cairo_image_surface_get_data(surface);
+    expect(data);
+    cairo_surface_t *band = cairo_image_surface_create_for_data(
+        data + (size_t)y * stride, CAIRO_FORMAT_ARGB32,
+        cairo_image_surface_get_width(surface), rows, stride);
+    cairo_t *cr = cairo_create(band);
+    cairo_surface_destroy(band);
     expect(cairo_status(cr) == CAIRO_STATUS_SUCCESS);
 
-    cairo_set_antialias(cr, CAIRO_ANTIALIAS_BEST);
+    cairo_set_antialias(cr, antialias);
     cairo_set_source_rgb(cr, 1.0, 1.0, 1.0);
     cairo_paint(cr);
+    cairo_translate(cr, 0, -y);
+    return cr;
+}
 
+static void end_band(cairo_t *cr) {
+    cairo_surface_flush(cairo_get_target(cr));
+    cairo_destroy(cr);
+}
+
+static void render_page_to_cairo_surface(PopplerPage *page,
+                                         cairo_surface_t *surface, int region,
+                                         double scale,
+                                         cairo_antialias_t antialias, int y,
+                                         int rows) {
+    cairo_t *cr = begin_band(surface, antialias, y, rows);
+    double page_width, page_height;
+    poppler_page_get_size(page, &page_width, &page_height);
     cairo_scale(cr, scale, scale);
+    cairo_translate(cr, -region * page_width / NUM_CTX, 0);
     poppler_page_render(page, cr);
-    cairo_surface_flush(surface);
-    cairo_destroy(cr);
+    end_band(cr);
+}
 
-    return surface;
+// Box filter weights for each destination pixel sum to 1 << BOX_SHIFT, and
+// are padded with zeroes to an even count to be taken in pairs
+struct bv_box_taps {
+    int *first, *count;
+    int16_t *weight; // max_taps per destination pixel
+    int max_taps;
+};
+
+static void box_taps_init(struct bv_box_taps *taps, int src, int dst) {
+    double ratio = (double)src / dst;
+    taps->max_taps = ((int)ceil(ratio) + 2) & ~1;
+    taps->first = malloc(dst * sizeof(*taps->first));
+    taps->count = malloc(dst * sizeof(*taps->count));
+    taps->weight = calloc((size_t)dst * taps->max_taps, sizeof(*taps->weight));
+    expect(taps->first && taps->count && taps->weight);
+
+    for (int i = 0; i < dst; i++) {
+        double lo = i * ratio, hi = (i + 1) * ratio;
+        int first = (int)lo, last = (int)ceil(hi) - 1;
+        if (last >= src)
+            last = src - 1;
+        if (last < first)
+            last = first;
+        int16_t *weight = taps->weight + (size_t)i * taps->max_taps;
+        int sum = 0, biggest = 0;
+        for (int j = first; j <= last; j++) {
+            double cover = fmin(hi, j + 1) - fmax(lo, j);
+            int k = j - first;
+            weight[k] = (int16_t)lrint(cover / ratio * (1 << BOX_SHIFT));
+            sum += weight[k];
+            if (weight[k] > weight[biggest])
+                biggest = k;
+        }
+        // Rounding may leave us a little off
+        weight[biggest] += (1 << BOX_SHIFT) - sum;
+        taps->first[i] = first;
+        taps->count[i] = last - first + 1;
+    }
 }
 
-static void invalidate_cache_slot(struct bv_cache_entry *slot) {
-    if (slot->cairo_surface)
-        cairo_surface_destroy(slot->cairo_surface);
-    *slot = (struct bv_cache_entry){.page_number = page_number_invalid};
+static void box_taps_free(struct bv_box_taps *taps) {
+    free(taps->first);
+    free(taps->count);
+    free(taps->weight);
 }
 
-enum cache_result { CACHE_UPDATED, CACHE_REUSED };
+static void box_rows_from(const uint8_t *const *rows, const int16_t *weight,
+                          int taps, uint8_t *out, int start, int len) {
+    for (int i = start; i < len; i++) {
+        int32_t acc = 1 << (BOX_SHIFT - 1);
+        for (int k = 0; k < taps; k++)
+            acc += rows[k][i] * weight[k];
+        out[i] = acc >> BOX_SHIFT;
+    }
+}
 
-static enum cache_result page_cache_update(struct bv_prog_state *state,
-                                           int page_index) {
-    struct bv_cache_entry *slot = cache_slot(state->page_cache, page_index);
+static void box_rows_scalar(const uint8_t *const *rows, const int16_t *weight,
+                            int taps, uint8_t *out, int len) {
+    box_rows_from(rows, weight, taps, out, 0, len);
+}
+
+static void box_cols_scalar(const uint8_t *row, const struct bv_box_taps *taps,
+                            uint8_t *out, int width) {
+    for (int x = 0; x < width; x++) {
+        const uint8_t *src = row + (size_t)taps->first[x] * 4;
+        const int16_t *weight = taps->weight + (size_t)x * taps->max_taps;
+        for (int c = 0; c < 4; c++) {
+            int32_t acc = 1 << (BOX_SHIFT - 1);
+            for (int k = 0; k < taps->count[x]; k++)
+                acc += src[k * 4 + c] * weight[k];
+            out[x * 4 + c] = acc >> BOX_SHIFT;
+        }
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// The SIMD versions take taps two at a time, interleaving samples from each
+// so that _mm_madd_epi16() can weight and sum the pair into 32 bits
+static int32_t weight_pair(const int16_t *weight, int k) {
+    int32_t pair;
+    memcpy(&pair, weight + k, sizeof(pair));
+    return pair;
+}
+
+__attribute__((target("sse2"))) static void
+box_rows_sse2(const uint8_t *const *rows, const int16_t *weight, int taps,
+              uint8_t *out, int len) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i round = _mm_set1_epi32(1 << (BOX_SHIFT - 1));
+    int i = 0;
+    for (; i + 16 <= len; i += 16) {
+        __m128i acc[4] = {round, round, round, round};
+        for (int k = 0; k < taps; k += 2) {
+            __m128i a = _mm_loadu_si128((const __m128i *)(rows[k] + i));
+            __m128i b =
+                k + 1 < taps
+                    ? _mm_loadu_si128((const __m128i *)(rows[k + 1] + i))
+                    : zero;
+            __m128i w = _mm_set1_epi32(weight_pair(weight, k));
+            __m128i lo = _mm_unpacklo_epi8(a, b);
+            __m128i hi = _mm_unpackhi_epi8(a, b);
+            __m128i wide[4] = {
+                _mm_unpacklo_epi8(lo, zero), _mm_unpackhi_epi8(lo, zero),
+                _mm_unpacklo_epi8(hi, zero), _mm_unpackhi_epi8(hi, zero)};
+            for (int j = 0; j < 4; j++)
+                acc[j] = _mm_add_epi32(acc[j], _mm_madd_epi16(wide[j], w));
+        }
+        for (int j = 0; j < 4; j++)
+            acc[j] = _mm_srai_epi32(acc[j], BOX_SHIFT);
+        __m128i packed =
+            _mm_packus_epi16(_mm_packs_epi32(acc[0], acc[1]),
+                             _mm_packs_epi32(acc[2], acc[3]));
+        _mm_storeu_si128((__m128i *)(out + i), packed);
+    }
+    box_rows_from(rows, weight, taps, out, i, len);
+}
+
+// As box_rows_sse2(). Unpacking and packing both work within 128-bit lanes,
+// so the bytes come back out in the order they went in.
+__attribute__((target("avx2"))) static void
+box_rows_avx2(const uint8_t *const *rows, const int16_t *weight, int taps,
+              uint8_t *out, int len) {
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i round = _mm256_set1_epi32(1 << (BOX_SHIFT - 1));
+    int i = 0;
+    for (; i + 32 <= len; i += 32) {
+        __m256i acc[4] = {round, round, round, round};
+        for (int k = 0; k < taps; k += 2) {
+            __m256i a = _mm256_loadu_si256((const __m256i *)(rows[k] + i));
+            __m256i b =
+                k + 1 < taps
+                    ? _mm256_loadu_si256((const __m256i *)(rows[k + 1] + i))
+                    : zero;
+            __m256i w = _mm256_set1_epi32(weight_pair(weight, k));
+            __m256i lo = _mm256_unpacklo_epi8(a, b);
+            __m256i hi = _mm256_unpackhi_epi8(a, b);
+            __m256i wide[4] = {
+                _mm256_unpacklo_epi8(lo, zero), _mm256_unpackhi_epi8(lo, zero),
+                _mm256_unpacklo_epi8(hi, zero), _mm256_unpackhi_epi8(hi, zero)};
+            for (int j = 0; j < 4; j++)
+                acc[j] =
+                    _mm256_add_epi32(acc[j], _mm256_madd_epi16(wide[j], w));
+        }
+        for (int j = 0; j < 4; j++)
+            acc[j] = _mm256_srai_epi32(acc[j], BOX_SHIFT);
+        __m256i packed =
+            _mm256_packus_epi16(_mm256_packs_epi32(acc[0], acc[1]),
+                                _mm256_packs_epi32(acc[2], acc[3]));
+        _mm256_storeu_si256((__m256i *)(out + i), packed);
+    }
+    box_rows_from(rows, weight, taps, out, i, len);
+}
+
+// Each pixel's four channels are summed in parallel. Pixels are loaded two at
+// a time, so row must have a pixel of padding at the end.
+__attribute__((target("sse2"))) static void
+box_cols_sse2(const uint8_t *row, const struct bv_box_taps *taps, uint8_t *out,
+              int width) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i round = _mm_set1_epi32(1 << (BOX_SHIFT - 1));
+    for (int x = 0; x < width; x++) {
+        const uint8_t *src = row + (size_t)taps->first[x] * 4;
+        const int16_t *weight = taps->weight + (size_t)x * taps->max_taps;
+        __m128i acc = round;
+        for (int k = 0; k < taps->count[x]; k += 2) {
+            __m128i px = _mm_unpacklo_epi8(
+                _mm_loadl_epi64((const __m128i *)(src + k * 4)), zero);
+            // BGRA BGRA to BB GG RR AA
+            px = _mm_unpacklo_epi16(px, _mm_srli_si128(px, 8));
+            __m128i w = _mm_set1_epi32(weight_pair(weight, k));
+            acc = _mm_add_epi32(acc, _mm_madd_epi16(px, w));
+        }
+        acc = _mm_srai_epi32(acc, BOX_SHIFT);
+        acc = _mm_packus_epi16(_mm_packs_epi32(acc, zero), zero);
+        int32_t px = _mm_cvtsi128_si32(acc);
+        memcpy(out + x * 4, &px, 4);
+    }
+}
+#endif
+
+static void (*box_rows)(const uint8_t *const *rows, const int16_t *weight,
+                        int taps, uint8_t *out, int len) = box_rows_scalar;
+static void (*box_cols)(const uint8_t *row, const struct bv_box_taps *taps,
+                        uint8_t *out, int width) = box_cols_scalar;
 
-    if (slot->page_number == page_index)
-        return CACHE_REUSED;
+static void downscale_surface(cairo_surface_t *src, cairo_surface_t *dst) {
+    int src_width = cairo_image_surface_get_width(src);
+    int src_height = cairo_image_surface_get_height(src);
+    int src_stride = cairo_image_surface_get_stride(src);
+    int dst_width = cairo_image_surface_get_width(dst);
+    int dst_height = cairo_image_surface_get_height(dst);
+    int dst_stride = cairo_image_surface_get_stride(dst);
+    const uint8_t *src_data = cairo_image_surface_get_data(src);
+    uint8_t *dst_data = cairo_image_surface_get_data(dst);
+    expect(src_data && dst_data);
+    expect(dst_width <= src_width && dst_height <= src_height);
+    if (dst_width <= 0 || dst_height <= 0)
+        return;
 
-    PopplerPage *page = poppler_document_get_page(state->document, page_index);
+    struct bv_box_taps cols, rows;
+    box_taps_init(&cols, src_width, dst_width);
+    box_taps_init(&rows, src_height, dst_height);
+    uint8_t *line = malloc(((size_t)src_width + 1) * 4);
+    const uint8_t **lines = malloc(rows.max_taps * sizeof(*lines));
+    expect(line && lines);
+
+    for (int y = 0; y < dst_height; y++) {
+        for (int k = 0; k < rows.count[y]; k++)
+            lines[k] = src_data + (size_t)(rows.first[y] + k) * src_stride;
+        box_rows(lines, rows.weight + (size_t)y * rows.max_taps,
+                 rows.count[y], line, src_width * 4);
+        box_cols(line, &cols, dst_data + (size_t)y * dst_stride, dst_width);
+    }
+
+    free(lines);
+    free(line);
+    box_taps_free(&rows);
+    box_taps_free(&cols);
+}
+
+// Rows are tokens: a literal followed by that many pixels, a run by one pixel
+// to repeat, or a repeat of the whole previous row
+#define PACK_LITERAL (0u << 30)
+#define PACK_RUN (1u << 30)
+#define PACK_REPEAT (2u << 30)
+#define PACK_TYPE (3u << 30)
+#define PACK_MIN_RUN 3
+
+static int run_length_scalar(const uint32_t *px, int n) {
+    int i = 1;
+    while (i < n && px[i] == px[0])
+        i++;
+    return i;
+}
+
+static void fill_pixels_scalar(uint32_t *dst, uint32_t px, int n) {
+    for (int i = 0; i < n; i++)
+        dst[i] = px;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2"))) static int run_length_sse2(const uint32_t *px,
+                                                            int n) {
+    const __m128i first = _mm_set1_epi32((int32_t)px[0]);
+    int i = 1;
+    for (; i + 4 <= n; i += 4) {
+        __m128i eq = _mm_cmpeq_epi32(
+            _mm_loadu_si128((const __m128i *)(px + i)), first);
+        unsigned mask = _mm_movemask_epi8(eq);
+        if (mask != 0xffff)
+            return i + __builtin_ctz(~mask) / 4;
+    }
+    return i + run_length_scalar(px + i - 1, n - i + 1) - 1;
+}
+
+__attribute__((target("avx2"))) static int run_length_avx2(const uint32_t *px,
+                                                            int n) {
+    const __m256i first = _mm256_set1_epi32((int32_t)px[0]);
+    int i = 1;
+    for (; i + 8 <= n; i += 8) {
+        __m256i eq = _mm256_cmpeq_epi32(
+            _mm256_loadu_si256((const __m256i *)(px + i)), first);
+        unsigned mask = _mm256_movemask_epi8(eq);
+        if (mask != 0xffffffffu)
+            return i + __builtin_ctz(~mask) / 4;
+    }
+    return i + run_length_scalar(px + i - 1, n - i + 1) - 1;
+}
+
+__attribute__((target("sse2"))) static void
+fill_pixels_sse2(uint32_t *dst, uint32_t px, int n) {
+    const __m128i v = _mm_set1_epi32((int32_t)px);
+    int i = 0;
+    for (; i + 4 <= n; i += 4)
+        _mm_storeu_si128((__m128i *)(dst + i), v);
+    fill_pixels_scalar(dst + i, px, n - i);
+}
+
+__attribute__((target("avx2"))) static void
+fill_pixels_avx2(uint32_t *dst, uint32_t px, int n) {
+    const __m256i v = _mm256_set1_epi32((int32_t)px);
+    int i = 0;
+    for (; i + 8 <= n; i += 8)
+        _mm256_storeu_si256((__m256i *)(dst + i), v);
+    fill_pixels_scalar(dst + i, px, n - i);
+}
+#endif
+
+static int (*run_length)(const uint32_t *px, int n) = run_length_scalar;
+static void (*fill_pixels)(uint32_t *dst, uint32_t px,
+                           int n) = fill_pixels_scalar;
+
+// Where two rows of pixels first and last differ, as an index into them. If
+// they're the same, first_diff() returns n and last_diff() returns -1.
+static int first_diff_scalar(const uint32_t *a, const uint32_t *b, int n) {
+    int i = 0;
+    while (i < n && a[i] == b[i])
+        i++;
+    return i;
+}
+
+static int last_diff_scalar(const uint32_t *a, const uint32_t *b, int n) {
+    int i = n - 1;
+    while (i >= 0 && a[i] == b[i])
+        i--;
+    return i;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2"))) static int
+first_diff_sse2(const uint32_t *a, const uint32_t *b, int n) {
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        unsigned mask = _mm_movemask_epi8(
+            _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *)(a + i)),
+                            _mm_loadu_si128((const __m128i *)(b + i))));
+        if (mask != 0xffff)
+            return i + __builtin_ctz(~mask) / 4;
+    }
+    return i + first_diff_scalar(a + i, b + i, n - i);
+}
+
+__attribute__((target("sse2"))) static int
+last_diff_sse2(const uint32_t *a, const uint32_t *b, int n) {
+    int i = n;
+    for (; i >= 4; i -= 4) {
+        unsigned mask = _mm_movemask_epi8(
+            _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *)(a + i - 4)),
+                            _mm_loadu_si128((const __m128i *)(b + i - 4))));
+        if (mask != 0xffff)
+            return i - 4 + (31 - __builtin_clz(~mask & 0xffff)) / 4;
+    }
+    return last_diff_scalar(a, b, i);
+}
+
+__attribute__((target("avx2"))) static int
+first_diff_avx2(const uint32_t *a, const uint32_t *b, int n) {
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        unsigned mask = _mm256_movemask_epi8(_mm256_cmpeq_epi32(
+            _mm256_loadu_si256((const __m256i *)(a + i)),
+            _mm256_loadu_si256((const __m256i *)(b + i))));
+        if (mask != 0xffffffffu)
+            return i + __builtin_ctz(~mask) / 4;
+    }
+    return i + first_diff_scalar(a + i, b + i, n - i);
+}
+
+__attribute__((target("avx2"))) static int
+last_diff_avx2(const uint32_t *a, const uint32_t *b, int n) {
+    int i = n;
+    for (; i >= 8; i -= 8) {
+        unsigned mask = _mm256_movemask_epi8(_mm256_cmpeq_epi32(
+            _mm256_loadu_si256((const __m256i *)(a + i - 8)),
+            _mm256_loadu_si256((const __m256i *)(b + i - 8))));
+        if (mask != 0xffffffffu)
+            return i - 8 + (31 - __builtin_clz(~mask)) / 4;
+    }
+    return last_diff_scalar(a, b, i);
+}
+#endif
+
+static int (*first_diff)(const uint32_t *a, const uint32_t *b,
+                         int n) = first_diff_scalar;
+static int (*last_diff)(const uint32_t *a, const uint32_t *b,
+                        int n) = last_diff_scalar;
+
+// Must be called before any threads are started
+static void init_simd(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2")) {
+        box_rows = box_rows_sse2;
+        box_cols = box_cols_sse2;
+        run_length = run_length_sse2;
+        fill_pixels = fill_pixels_sse2;
+        first_diff = first_diff_sse2;
+        last_diff = last_diff_sse2;
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        box_rows = box_rows_avx2;
+        run_length = run_length_avx2;
+        fill_pixels = fill_pixels_avx2;
+        first_diff = first_diff_avx2;
+        last_diff = last_diff_avx2;
+    }
+#endif
+}
+
+// Returns the packed pixels, in a buffer of *len bytes
+static uint32_t *pack_surface(cairo_surface_t *surface, size_t *len) {
+    int width = cairo_image_surface_get_width(surface);
+    int height = cairo_image_surface_get_height(surface);
+    int stride = cairo_image_surface_get_stride(surface);
+    const unsigned char *data = cairo_image_surface_get_data(surface);
+    expect(data);
+    // At worst, every row is one literal
+    uint32_t *packed = malloc(((size_t)width + 1) * height * sizeof(*packed));
+    expect(packed);
+
+    uint32_t *out = packed;
+    for (int y = 0; y < height; y++) {
+        const uint32_t *row = (const uint32_t *)(data + (size_t)y * stride);
+        if (y > 0 && memcmp(row, data + (size_t)(y - 1) * stride,
+                            (size_t)width * 4) == 0) {
+            *out++ = PACK_REPEAT;
+            continue;
+        }
+        int literal = 0;
+        for (int x = 0; x < width;) {
+            int run = x + 1 < width && row[x + 1] == row[x]
+                          ? run_length(row + x, width - x)
+                          : 1;
+            if (run < PACK_MIN_RUN && x + run < width) {
+                x += run;
+                continue;
+            }
+            if (run < PACK_MIN_RUN)
+                x += run;
+            if (x > literal) {
+                *out++ = PACK_LITERAL | (x - literal);
+                memcpy(out, row + literal, (size_t)(x - literal) * 4);
+                out += x - literal;
+            }
+            if (run >= PACK_MIN_RUN) {
+                *out++ = PACK_RUN | run;
+                *out++ = row[x];
+                x += run;
+            }
+            literal = x;
+        }
+    }
+
+    *len = (size_t)(out - packed) * sizeof(*packed);
+    uint32_t *shrunk = realloc(packed, *len);
+    return shrunk ? shrunk : packed;
+}
+
+static void unpack_surface(const uint32_t *packed, cairo_surface_t *surface) {
+    int width = cairo_image_surface_get_width(surface);
+    int height = cairo_image_surface_get_height(surface);
+    int stride = cairo_image_surface_get_stride(surface);
+    unsigned char *data = cairo_image_surface_get_data(surface);
+    expect(data);
+
+    for (int y = 0; y < height; y++) {
+        uint32_t *row = (uint32_t *)(data + (size_t)y * stride);
+        for (int x = 0; x < width;) {
+            uint32_t token = *packed++;
+            int n = token & ~PACK_TYPE;
+            switch (token & PACK_TYPE) {
+                case PACK_LITERAL:
+                    memcpy(row + x, packed, (size_t)n * 4);
+                    packed += n;
+                    x += n;
+                    break;
+                case PACK_RUN:
+                    fill_pixels(row + x, *packed++, n);
+                    x += n;
+                    break;
+                default:
+                    memcpy(row, data + (size_t)(y - 1) * stride,
+                           (size_t)width * 4);
+                    x = width;
+                    break;
+            }
+        }
+    }
+    cairo_surface_mark_dirty(surface);
+}
+
+static void cache_unlink(struct bv_page_cache *cache,
+                         struct bv_cache_entry *entry) {
+    if (entry->prev)
+        entry->prev->next = entry->next;
+    else
+        cache->head = entry->next;
+    if (entry->next)
+        entry->next->prev = entry->prev;
+    else
+        cache->tail = entry->prev;
+    entry->prev = entry->next = NULL;
+}
+
+static void cache_push_head(struct bv_page_cache *cache,
+                            struct bv_cache_entry *entry) {
+    entry->prev = NULL;
+    entry->next = cache->head;
+    if (cache->head)
+        cache->head->prev = entry;
+    else
+        cache->tail = entry;
+    cache->head = entry;
+}
+
+static void cache_remove(struct bv_page_cache *cache,
+                         struct bv_cache_entry *entry) {
+    cache_unlink(cache, entry);
+    cache->bytes -= entry->bytes;
+    cairo_surface_destroy(entry->cairo_surface);
+    free(entry->packed);
+    free(entry);
+}
+
+// scale may be scale_any, in which case the most recently used entry for the
+// region wins. Unlike cache_lookup(), this doesn't count as a use.
+static struct bv_cache_entry *cache_peek(struct bv_page_cache *cache,
+                                         int page_index, int region,
+                                         double scale) {
+    for (struct bv_cache_entry *e = cache->head; e; e = e->next)
+        if (e->page_number == page_index && e->region == region &&
+            (scale == scale_any || e->scale == scale))
+            return e;
+    return NULL;
+}
+
+static struct bv_cache_entry *cache_lookup(struct bv_page_cache *cache,
+                                           int page_index, int region,
+                                           double scale) {
+    struct bv_cache_entry *e = cache_peek(cache, page_index, region, scale);
+    if (e) {
+        cache_unlink(cache, e);
+        cache_push_head(cache, e);
+    }
+    return e;
+}
+
+static void render_pool_pack(struct bv_render_pool *pool,
+                             struct bv_cache_entry *entry);
+
+// Entries restored from the compressed tier keep their packed copy
+static void cache_spill(struct bv_page_cache *cache,
+                        struct bv_cache_entry *entry) {
+    if (cache_lookup(cache->spill, entry->page_number, entry->region,
+                     entry->scale)) {
+        cache_remove(cache, entry);
+        return;
+    }
+    cache_unlink(cache, entry);
+    cache->bytes -= entry->bytes;
+    render_pool_pack(cache->packer, entry);
+}
+
+// Stale scales go first, then least recently used. The page on screen and
+// its preview are never evicted.
+static void cache_evict(struct bv_page_cache *cache, int keep_page,
+                        const double region_scale[]) {
+    for (int pass = 0; pass < 2 && cache->bytes > cache->budget; pass++) {
+        struct bv_cache_entry *e = cache->tail;
+        while (e && cache->bytes > cache->budget) {
+            struct bv_cache_entry *prev = e->prev;
+            int stale = e->scale != region_scale[e->region];
+            int keep = e->page_number == keep_page;
+            if (!keep && !stale && pass == 1 && cache->spill)
+                cache_spill(cache, e);
+            else if (!keep && (stale || pass == 1))
+                cache_remove(cache, e);
+            e = prev;
+        }
+    }
+}
+
+static void cache_drop_other_scales(struct bv_page_cache *cache,
+                                    int page_index, int region,
+                                    double scale) {
+    struct bv_cache_entry *e = cache->head;
+    while (e) {
+        struct bv_cache_entry *next = e->next;
+        if (e->page_number == page_index && e->region == region &&
+            e->scale != scale)
+            cache_remove(cache, e);
+        e = next;
+    }
+}
+
+static void cache_insert(struct bv_page_cache *cache,
+                         const struct bv_cache_entry *result) {
+    struct bv_cache_entry *entry = malloc(sizeof(*entry));
+    expect(entry);
+    *entry = *result;
+    entry->bytes =
+        (size_t)cairo_image_surface_get_stride(entry->cairo_surface) *
+        entry->img_height;
+    cache->bytes += entry->bytes;
+    cache_push_head(cache, entry);
+}
+
+static void cache_clear(struct bv_page_cache *cache) {
+    while (cache->head)
+        cache_remove(cache, cache->head);
+}
+
+static void get_page_size(PopplerDocument *document, int page_index,
+                          double *page_width, double *page_height) {
+    PopplerPage *page = poppler_document_get_page(document, page_index);
     expect(page);
-    invalidate_cache_slot(slot);
+    poppler_page_get_size(page, page_width, page_height);
+    g_object_unref(page);
+}
+
+static char *disk_cache_path(const char *dir, int page_index, int region,
+                             int width, int height) {
+    return g_strdup_printf("%s/%d-%d-%dx%d.argb", dir, page_index, region,
+                           width, height);
+}
+
+struct bv_mapping {
+    void *addr;
+    size_t len;
+};
+
+static const cairo_user_data_key_t mapping_key;
+
+static void free_mapping(void *data) {
+    struct bv_mapping *mapping = data;
+    munmap(mapping->addr, mapping->len);
+    free(mapping);
+}
+
+// NULL unless there's a valid render of that size
+static cairo_surface_t *disk_cache_load(const char *dir, int page_index,
+                                        int region, int width, int height) {
+    char *path = disk_cache_path(dir, page_index, region, width, height);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    g_free(path);
+    if (fd < 0)
+        return NULL;
+
+    struct stat st;
+    void *addr = MAP_FAILED;
+    if (fstat(fd, &st) == 0 &&
+        (size_t)st.st_size > sizeof(struct bv_disk_header))
+        addr = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd,
+                    0);
+    close(fd);
+    if (addr == MAP_FAILED)
+        return NULL;
+
+    const struct bv_disk_header *hdr = addr;
+    if (memcmp(hdr->magic, DISK_CACHE_MAGIC, sizeof(hdr->magic)) ||
+        hdr->width != (uint32_t)width || hdr->height != (uint32_t)height ||
+        hdr->stride != (uint32_t)cairo_format_stride_for_width(
+                           CAIRO_FORMAT_ARGB32, width) ||
+        (size_t)st.st_size != sizeof(*hdr) + (size_t)hdr->stride * height) {
+        munmap(addr, st.st_size);
+        return NULL;
+    }
+
+    cairo_surface_t *surface = cairo_image_surface_create_for_data(
+        (unsigned char *)addr + sizeof(*hdr), CAIRO_FORMAT_ARGB32, width,
+        height, hdr->stride);
+    struct bv_mapping *mapping = malloc(sizeof(*mapping));
+    expect(mapping);
+    *mapping = (struct bv_mapping){addr, st.st_size};
+    expect(cairo_surface_set_user_data(surface, &mapping_key, mapping,
+                                       free_mapping) ==
+           CAIRO_STATUS_SUCCESS);
+    return surface;
+}
+
+static void disk_cache_migrate(const char *old_dir, int old_page,
+                               const char *new_dir, int new_page, int region,
+                               int width, int height) {
+    char *old_path = disk_cache_path(old_dir, old_page, region, width, height);
+    char *new_path = disk_cache_path(new_dir, new_page, region, width, height);
+    if (link(old_path, new_path) != 0 && errno != ENOENT && errno != EEXIST)
+        fprintf(stderr, "Warning: Couldn't carry over %s: %s\n", old_path,
+                strerror(errno));
+    g_free(new_path);
+    g_free(old_path);
+}
+
+// Temporary files are left to their writers
+static void disk_cache_drop_other_sizes(const char *dir, const char *keep,
+                                        int page_index, int region) {
+    GDir *d = g_dir_open(dir, 0, NULL);
+    if (!d)
+        return;
+    char *prefix = g_strdup_printf("%d-%d-", page_index, region);
+    const char *name;
+    while ((name = g_dir_read_name(d))) {
+        if (!g_str_has_prefix(name, prefix) ||
+            !g_str_has_suffix(name, ".argb") || strcmp(name, keep) == 0)
+            continue;
+        char *path = g_build_filename(dir, name, NULL);
+        unlink(path);
+        g_free(path);
+    }
+    g_free(prefix);
+    g_dir_close(d);
+}
+
+// Renamed into place, so readers never see a torn file
+static void disk_cache_store(const char *dir,
+                             const struct bv_cache_entry *entry) {
+    char *path = disk_cache_path(dir, entry->page_number, entry->region,
+                                 entry->img_width, entry->img_height);
+    char *tmp_path = g_strdup_printf("%s.XXXXXX", path);
+    int fd = mkstemp(tmp_path);
+    FILE *f = fd >= 0 ? fdopen(fd, "wb") : NULL;
+    int ok = f != NULL;
+
+    if (ok) {
+        int stride = cairo_image_surface_get_stride(entry->cairo_surface);
+        const unsigned char *data =
+            cairo_image_surface_get_data(entry->cairo_surface);
+        struct bv_disk_header hdr = {
+            .magic = DISK_CACHE_MAGIC,
+            .width = entry->img_width,
+            .height = entry->img_height,
+            .stride = cairo_format_stride_for_width(CAIRO_FORMAT_ARGB32,
+                                                    entry->img_width),
+        };
+        ok = fwrite(&hdr, sizeof(hdr), 1, f) == 1;
+        for (int y = 0; ok && y < entry->img_height; y++)
+            ok = fwrite(data + (size_t)y * stride, hdr.stride, 1, f) == 1;
+        ok = fclose(f) == 0 && ok;
+    } else if (fd >= 0) {
+        close(fd);
+    }
+
+    if (ok && rename(tmp_path, path) == 0) {
+        char *name = g_path_get_basename(path);
+        disk_cache_drop_other_sizes(dir, name, entry->page_number,
+                                    entry->region);
+        g_free(name);
+        g_free(tmp_path);
+        g_free(path);
+        return;
+    }
+
+    fprintf(stderr, "Warning: Couldn't write %s: %s\n", path,
+            strerror(errno));
+    if (fd >= 0)
+        unlink(tmp_path);
+    g_free(tmp_path);
+    g_free(path);
+}
+
+static void remove_disk_cache_dir(const char *dir) {
+    GDir *d = g_dir_open(dir, 0, NULL);
+    if (!d)
+        return;
+    const char *name;
+    while ((name = g_dir_read_name(d))) {
+        char *path = g_build_filename(dir, name, NULL);
+        unlink(path);
+        g_free(path);
+    }
+    g_dir_close(d);
+    if (rmdir(dir) != 0)
+        fprintf(stderr, "Warning: Couldn't remove %s: %s\n", dir,
+                strerror(errno));
+}
+
+static PopplerDocument *load_document(const char *uri, GBytes *bytes) {
+    GError *error = NULL;
+    PopplerDocument *document =
+        bytes ? poppler_document_new_from_bytes(bytes, NULL, &error)
+              : poppler_document_new_from_file(uri, NULL, &error);
+    die_on(!document, "Error opening PDF: %s\n", error->message);
+    return document;
+}
+
+static struct bv_render_job *next_queued_job(struct bv_render_pool *pool) {
+    struct bv_render_job *best = NULL;
+    for (struct bv_render_job *job = pool->jobs; job; job = job->next)
+        if (!job->cancelled && job->next_row < job->result.img_height &&
+            (!best || job->priority < best->priority))
+            best = job;
+    return best;
+}
+
+static void unlink_job(struct bv_render_pool *pool, struct bv_render_job *job) {
+    for (struct bv_render_job **pp = &pool->jobs; *pp; pp = &(*pp)->next) {
+        if (*pp == job) {
+            *pp = job->next;
+            return;
+        }
+    }
+    expect(0);
+}
 
-    slot->cairo_surface = render_page_to_cairo_surface(
-        page, state->current_scale, &slot->img_width, &slot->img_height,
-        &slot->page_width, &slot->page_height);
+static void unlock_texture(struct bv_texture *texdata) {
+    SDL_UnlockTexture(texdata->texture);
+    texdata->locked = 0;
+}
+
+// Only called from the main thread, since it may need to unlock a texture
+static void free_job(struct bv_render_job *job) {
+    cairo_surface_destroy(job->result.cairo_surface);
+    free(job->result.packed);
+    free(job->unpack);
+    if (job->source)
+        cairo_surface_destroy(job->source);
+    if (job->target) {
+        unlock_texture(job->target);
+        job->target->page_number = page_number_invalid;
+    }
+    free(job);
+}
+
+// Only the page being waited on is banded, since each band interprets the
+// page again. Without workers prefetches are too, so input is never held up.
+static int next_band_rows(struct bv_render_pool *pool,
+                          struct bv_render_job *job) {
+    int remaining = job->result.img_height - job->next_row;
+    if (job->source || job->unpack || job->thumbnail || job->pack ||
+        job->store || (job->priority > 0 && pool->num_workers))
+        return remaining;
+    int band = (job->result.img_height + pool->tiles - 1) / pool->tiles;
+    return band < remaining ? band : remaining;
+}
+
+// Called with the pool lock held and the job already unlinked
+static void complete_job(struct bv_render_pool *pool,
+                         struct bv_render_job *job) {
+    cairo_surface_mark_dirty(job->result.cairo_surface);
+    if (job->sync) {
+        job->done = 1;
+        SDL_CondBroadcast(pool->done_cond);
+    } else {
+        SDL_Event event = {.user = {.type = render_done_event, .data1 = job}};
+        expect(SDL_PushEvent(&event) == 1);
+    }
+}
+
+// Embedded thumbnails cover the whole page, so are scaled to fit one region
+static int paint_embedded_thumbnail(PopplerPage *page,
+                                    cairo_surface_t *surface, int region) {
+    cairo_surface_t *thumb = poppler_page_get_thumbnail(page);
+    if (!thumb)
+        return 0;
+    double thumb_width = cairo_image_surface_get_width(thumb);
+    double thumb_height = cairo_image_surface_get_height(thumb);
+
+    cairo_t *cr = cairo_create(surface);
+    cairo_scale(cr,
+                cairo_image_surface_get_width(surface) * NUM_CTX / thumb_width,
+                cairo_image_surface_get_height(surface) / thumb_height);
+    cairo_translate(cr, -region * thumb_width / NUM_CTX, 0);
+    cairo_set_source_surface(cr, thumb, 0, 0);
+    cairo_pattern_set_filter(cairo_get_source(cr), CAIRO_FILTER_GOOD);
+    cairo_paint(cr);
+    cairo_destroy(cr);
+    cairo_surface_destroy(thumb);
+    return 1;
+}
+
+static void render_band(PopplerDocument *document, cairo_surface_t *surface,
+                        const struct bv_band *band) {
+    PopplerPage *page = poppler_document_get_page(document, band->page_index);
+    expect(page);
+    if (!band->thumbnail ||
+        !paint_embedded_thumbnail(page, surface, band->region))
+        render_page_to_cairo_surface(page, surface, band->region, band->scale,
+                                     band->antialias, band->y, band->rows);
+    g_object_unref(page);
+}
+
+static void count_op(cairo_surface_t *observer, cairo_surface_t *target,
+                     void *data) {
+    (void)observer;
+    (void)target;
+    (*(size_t *)data)++;
+}
+
+static void free_recording(struct bv_recording *rec) {
+    cairo_surface_destroy(rec->surface);
+    free(rec);
+}
+
+// Recordings are opaque, so their size is estimated
+static void record_page(PopplerDocument *document, struct bv_recording *rec) {
+    PopplerPage *page = poppler_document_get_page(document, rec->page_index);
+    expect(page);
+    double page_width, page_height, scale = rec->scale;
+    poppler_page_get_size(page, &page_width, &page_height);
+    cairo_rectangle_t extents = {0, 0, page_width * scale,
+                                 page_height * scale};
+
+    cairo_surface_t *surface =
+        cairo_recording_surface_create(CAIRO_CONTENT_COLOR_ALPHA, &extents);
+    cairo_surface_t *observer =
+        cairo_surface_create_observer(surface, CAIRO_SURFACE_OBSERVER_NORMAL);
+    size_t ops = 0;
+    cairo_surface_observer_add_paint_callback(observer, count_op, &ops);
+    cairo_surface_observer_add_mask_callback(observer, count_op, &ops);
+    cairo_surface_observer_add_fill_callback(observer, count_op, &ops);
+    cairo_surface_observer_add_stroke_callback(observer, count_op, &ops);
+    cairo_surface_observer_add_glyphs_callback(observer, count_op, &ops);
+    cairo_t *cr = cairo_create(observer);
+    expect(cairo_status(cr) == CAIRO_STATUS_SUCCESS);
+    cairo_set_antialias(cr, CAIRO_ANTIALIAS_BEST);
+    cairo_scale(cr, scale, scale);
+    poppler_page_render(page, cr);
+    cairo_destroy(cr);
+    cairo_surface_destroy(observer);
+
+    size_t bytes = ops * RECORD_OP_BYTES;
+    GList *mappings = poppler_page_get_image_mapping(page);
+    for (GList *l = mappings; l; l = l->next) {
+        const PopplerRectangle *area =
+            &((const PopplerImageMapping *)l->data)->area;
+        bytes += (size_t)(fabs(area->x2 - area->x1) * scale *
+                          fabs(area->y2 - area->y1) * scale) *
+                 4;
+    }
+    poppler_page_free_image_mapping(mappings);
+    g_object_unref(page);
+
+    rec->surface = surface;
+    rec->page_width = page_width;
+    rec->bytes = bytes;
+}
+
+// Must be called with the pool lock held. Moves the recording to the front.
+static struct bv_recording *find_recording(struct bv_render_pool *pool,
+                                           int page_index) {
+    for (struct bv_recording **pp = &pool->recordings; *pp;
+         pp = &(*pp)->next) {
+        struct bv_recording *rec = *pp;
+        if (rec->page_index == page_index) {
+            *pp = rec->next;
+            rec->next = pool->recordings;
+            pool->recordings = rec;
+            return rec;
+        }
+    }
+    return NULL;
+}
+
+// Must be called with the pool lock held. The most recent recording is always
+// kept, even if it alone is over budget, as are those still being made.
+static void evict_recordings(struct bv_render_pool *pool) {
+    while (pool->record_bytes > pool->record_budget) {
+        struct bv_recording **victim = NULL;
+        for (struct bv_recording **pp = &pool->recordings; *pp;
+             pp = &(*pp)->next)
+            if (pp != &pool->recordings && (*pp)->surface)
+                victim = pp;
+        if (!victim)
+            break;
+        struct bv_recording *rec = *victim;
+        *victim = rec->next;
+        pool->record_bytes -= rec->bytes;
+        free_recording(rec);
+    }
+}
+
+// Holds a reference to the surface for the caller. Bands of a page being
+// recorded wait for it rather than each record it.
+static struct bv_recording get_recording(struct bv_render_worker *worker,
+                                         int page_index, double scale) {
+    struct bv_render_pool *pool = worker->pool;
+    SDL_LockMutex(pool->lock);
+    struct bv_recording *rec;
+    while ((rec = find_recording(pool, page_index)) && !rec->surface)
+        SDL_CondWait(pool->record_cond, pool->lock);
+    if (rec && rec->scale < scale) {
+        // Too small to replay sharply, find_recording() put it at the front
+        pool->recordings = rec->next;
+        pool->record_bytes -= rec->bytes;
+        free_recording(rec);
+        rec = NULL;
+    }
+    if (!rec) {
+        rec = malloc(sizeof(*rec));
+        expect(rec);
+        *rec = (struct bv_recording){.page_index = page_index,
+                                     .next = pool->recordings};
+        rec->scale = SDL_max(scale, pool->record_scale);
+        pool->recordings = rec;
+        SDL_UnlockMutex(pool->lock);
+        record_page(worker->document, rec);
+        SDL_LockMutex(pool->lock);
+        find_recording(pool, page_index);
+        pool->record_bytes += rec->bytes;
+        evict_recordings(pool);
+        SDL_CondBroadcast(pool->record_cond);
+    }
+    struct bv_recording copy = *rec;
+    cairo_surface_reference(copy.surface);
+    SDL_UnlockMutex(pool->lock);
+    return copy;
+}
+
+// cairo replays at the destination's resolution, so this is as sharp as a
+// fresh render
+static void replay_band(const struct bv_recording *rec,
+                        cairo_surface_t *surface, const struct bv_band *band) {
+    cairo_t *cr = begin_band(surface, band->antialias, band->y, band->rows);
+    double scale = band->scale / rec->scale;
+    cairo_scale(cr, scale, scale);
+    cairo_translate(cr, -band->region * rec->page_width * rec->scale / NUM_CTX,
+                    0);
+    cairo_set_source_surface(cr, rec->surface, 0, 0);
+    cairo_paint(cr);
+    end_band(cr);
+}
+
+static void recording_report(struct bv_render_pool *pool) {
+    if (!pool->record_budget)
+        return;
+    SDL_LockMutex(pool->lock);
+    int count = 0;
+    const struct bv_recording *largest = NULL;
+    for (const struct bv_recording *rec = pool->recordings; rec;
+         rec = rec->next) {
+        if (!rec->surface)
+            continue;
+        count++;
+        if (!largest || rec->bytes > largest->bytes)
+            largest = rec;
+    }
+    fprintf(stderr, "Recordings: %d pages in about %.1f of %.1f MiB", count,
+            pool->record_bytes / 1048576.0, pool->record_budget / 1048576.0);
+    if (largest)
+        fprintf(stderr, ", largest is page %d at %.1f MiB", largest->page_index,
+                largest->bytes / 1048576.0);
+    fputc('\n', stderr);
+    SDL_UnlockMutex(pool->lock);
+}
+
+static struct bv_band job_band(const struct bv_render_job *job, int y,
+                               int rows) {
+    cairo_surface_t *surface = job->result.cairo_surface;
+    return (struct bv_band){
+        .page_index = job->page_index,
+        .region = job->region,
+        .thumbnail = job->thumbnail,
+        .y = y,
+        .rows = rows,
+        .width = job->result.img_width,
+        .height = job->result.img_height,
+        .stride = cairo_image_surface_get_stride(surface),
+        .scale = job->scale,
+        .antialias = job->preview || job->thumbnail ? CAIRO_ANTIALIAS_FAST
+                                                    : job->antialias,
+    };
+}
+
+// Stands in for a band whose render process died or hung
+static void blank_band(cairo_surface_t *surface, int y, int rows) {
+    cairo_t *cr = cairo_create(surface);
+    cairo_rectangle(cr, 0, y, cairo_image_surface_get_width(surface), rows);
+    cairo_set_source_rgb(cr, 1.0, 1.0, 1.0);
+    cairo_fill(cr);
+    cairo_destroy(cr);
+    cairo_surface_flush(surface);
+}
+
+static int send_with_fd(int sock, const void *buf, size_t len, int fd) {
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct iovec iov = {(void *)buf, len};
+    struct msghdr msg = {.msg_iov = &iov,
+                         .msg_iovlen = 1,
+                         .msg_control = control.buf,
+                         .msg_controllen = sizeof(control.buf)};
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(fd));
+    return sendmsg(sock, &msg, MSG_NOSIGNAL) == (ssize_t)len;
+}
+
+static ssize_t recv_with_fd(int sock, void *buf, size_t len, int *fd) {
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct iovec iov = {buf, len};
+    struct msghdr msg = {.msg_iov = &iov,
+                         .msg_iovlen = 1,
+                         .msg_control = control.buf,
+                         .msg_controllen = sizeof(control.buf)};
+    *fd = -1;
+#ifdef MSG_CMSG_CLOEXEC
+    ssize_t ret = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+#else
+    ssize_t ret = recvmsg(sock, &msg, 0);
+#endif
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); ret > 0 && cmsg;
+         cmsg = CMSG_NXTHDR(&msg, cmsg))
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+            memcpy(fd, CMSG_DATA(cmsg), sizeof(*fd));
+#ifndef MSG_CMSG_CLOEXEC
+    if (*fd >= 0)
+        fcntl(*fd, F_SETFD, FD_CLOEXEC);
+#endif
+    return ret;
+}
+
+// A re-exec rather than a bare fork, so it has none of our threads' locks
+static int farm_spawn(struct bv_render_worker *worker) {
+    struct bv_render_pool *pool = worker->pool;
+    int fds[2];
+#ifdef SOCK_CLOEXEC
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fds) != 0)
+        return 0;
+#else
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, fds) != 0)
+        return 0;
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+#endif
+#ifdef SO_NOSIGPIPE
+    int one = 1;
+    setsockopt(fds[0], SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
+    setsockopt(fds[1], SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
+#endif
+    int child_sock = fcntl(fds[1], F_DUPFD_CLOEXEC, FARM_FD_MIN);
+    close(fds[1]);
+    if (child_sock < 0) {
+        close(fds[0]);
+        return 0;
+    }
+
+    char *argv[] = {"/proc/self/exe", "--render-worker",
+                    pool->doc_fd >= 0 ? "-" : (char *)pool->uri, NULL};
+    pid_t pid = fork();
+    if (pid == 0) {
+#ifdef __linux__
+        prctl(PR_SET_PDEATHSIG, SIGKILL);
+#endif
+        if (dup2(child_sock, FARM_SOCK_FD) < 0 ||
+            (pool->doc_fd >= 0 && dup2(pool->doc_fd, FARM_DOC_FD) < 0))
+            _exit(127);
+        execv(argv[0], argv);
+        _exit(127);
+    }
+    close(child_sock);
+    if (pid < 0) {
+        close(fds[0]);
+        return 0;
+    }
+    worker->pid = pid;
+    worker->sock = fds[0];
+    return 1;
+}
+
+static void farm_kill(struct bv_render_worker *worker) {
+    if (!worker->pid)
+        return;
+    kill(worker->pid, SIGKILL);
+    waitpid(worker->pid, NULL, 0);
+    close(worker->sock);
+    worker->pid = 0;
+    worker->sock = -1;
+}
+
+// Returns 0 if the render process failed, in which case it's been killed
+static int farm_render(struct bv_render_worker *worker,
+                       cairo_surface_t *surface, const struct bv_band *band) {
+    if (!worker->pid && !farm_spawn(worker))
+        return 0;
+    struct bv_shared_mapping *mapping =
+        cairo_surface_get_user_data(surface, &shared_mapping_key);
+    expect(mapping);
+
+    int status;
+    struct pollfd pfd = {.fd = worker->sock, .events = POLLIN};
+    if (send_with_fd(worker->sock, band, sizeof(*band), mapping->fd) &&
+        poll(&pfd, 1, RENDER_TIMEOUT_MS) == 1 &&
+        recv(worker->sock, &status, sizeof(status), 0) == sizeof(status) &&
+        status == 0)
+        return 1;
+    farm_kill(worker);
+    return 0;
+}
+
+// Called with the pool lock held. Surfaces wait until the job starts.
+static void create_job_surface(struct bv_render_pool *pool,
+                               struct bv_render_job *job) {
+    struct bv_cache_entry *res = &job->result;
+    res->cairo_surface =
+        pool->isolate ? create_shared_surface(res->img_width, res->img_height)
+                      : create_page_surface(res->img_width, res->img_height);
+}
+
+// Called with the pool lock held, which is dropped while rendering
+static int render_next_band(struct bv_render_worker *worker) {
+    struct bv_render_pool *pool = worker->pool;
+    struct bv_render_job *job = next_queued_job(pool);
+    if (!job)
+        return 0;
+    int y = job->next_row;
+    int rows = next_band_rows(pool, job);
+    job->next_row += rows;
+    // Downscales are handed out whole, so the source is ours now
+    cairo_surface_t *source = job->source;
+    job->source = NULL;
+    if (!y && !job->result.cairo_surface)
+        create_job_surface(pool, job);
+    int timed = !source && !job->unpack && !job->pack && !job->store;
+    if (timed && !job->busy++)
+        job->busy_since = now_ms();
+    SDL_UnlockMutex(pool->lock);
+
+    struct bv_band band = job_band(job, y, rows);
+    int ok = 1;
+    if (job->pack) {
+        job->result.packed =
+            pack_surface(job->result.cairo_surface, &job->result.bytes);
+    } else if (job->store) {
+        disk_cache_store(pool->disk_cache_dir, &job->result);
+    } else if (source) {
+        downscale_surface(source, job->result.cairo_surface);
+        cairo_surface_destroy(source);
+    } else if (job->unpack) {
+        unpack_surface(job->unpack, job->result.cairo_surface);
+    } else if (pool->isolate) {
+        ok = farm_render(worker, job->result.cairo_surface, &band);
+    } else if (pool->record_budget && !job->preview && !job->thumbnail &&
+               job->antialias == CAIRO_ANTIALIAS_BEST) {
+        // Recordings replay with the antialiasing they were made with
+        struct bv_recording rec =
+            get_recording(worker, job->page_index, job->scale);
+        replay_band(&rec, job->result.cairo_surface, &band);
+        cairo_surface_destroy(rec.surface);
+    } else {
+        render_band(worker->document, job->result.cairo_surface, &band);
+    }
+    if (!ok) {
+        fprintf(stderr,
+                "Warning: Render process failed on page %d, "
+                "restarting it\n",
+                job->page_index);
+        blank_band(job->result.cairo_surface, y, rows);
+    }
+
+    SDL_LockMutex(pool->lock);
+    job->rows_done += rows;
+    job->failed |= !ok;
+    if (timed && !--job->busy)
+        job->render_ms += now_ms() - job->busy_since;
+    if (job->rows_done == job->next_row &&
+        (job->cancelled || job->next_row == job->result.img_height)) {
+        close_shared_fd(job->result.cairo_surface);
+        unlink_job(pool, job);
+        complete_job(pool, job);
+    }
+    return 1;
+}
+
+static int render_worker(void *data) {
+    struct bv_render_worker *worker = data;
+    struct bv_render_pool *pool = worker->pool;
+
+    SDL_LockMutex(pool->lock);
+    while (!pool->quit)
+        if (!render_next_band(worker))
+            SDL_CondWait(pool->cond, pool->lock);
+    SDL_UnlockMutex(pool->lock);
+
+    return 0;
+}
+
+// Without workers, the main thread renders a band at a time between events
+static int render_pool_step(struct bv_render_pool *pool) {
+    SDL_LockMutex(pool->lock);
+    int rendered = render_next_band(&pool->workers[0]);
+    SDL_UnlockMutex(pool->lock);
+    return rendered;
+}
+
+static int create_document_memfd(GBytes *bytes) {
+    gsize len;
+    const char *data = g_bytes_get_data(bytes, &len);
+    int memfd = create_memfd("bv_pdf");
+    expect(memfd >= 0);
+    for (gsize done = 0; done < len;) {
+        ssize_t ret = write(memfd, data + done, len - done);
+        expect(ret > 0 || errno == EINTR);
+        if (ret > 0)
+            done += ret;
+    }
+    int fd = fcntl(memfd, F_DUPFD_CLOEXEC, FARM_FD_MIN);
+    expect(fd >= 0);
+    close(memfd);
+    return fd;
+}
+
+static struct bv_render_pool *render_pool_new(const char *uri, GBytes *bytes,
+                                             int workers, int tiles,
+                                             int isolate, size_t record_budget,
+                                             const char *disk_cache_dir) {
+    struct bv_render_pool *pool = calloc(1, sizeof(*pool));
+    expect(pool);
+    pool->lock = SDL_CreateMutex();
+    pool->cond = SDL_CreateCond();
+    pool->done_cond = SDL_CreateCond();
+    pool->record_cond = SDL_CreateCond();
+    expect(pool->lock && pool->cond && pool->done_cond && pool->record_cond);
+
+    // Poppler documents aren't thread safe, so each worker has its own.
+    // Without workers, workers[0] is the main thread's.
+    pool->num_workers = workers < 0 ? SDL_max(SDL_GetCPUCount(), 1) : workers;
+    if (pool->num_workers > MAX_WORKERS)
+        pool->num_workers = MAX_WORKERS;
+    if (!tiles)
+        tiles = pool->num_workers ? pool->num_workers : INLINE_TILES;
+    pool->tiles = tiles;
+    pool->disk_cache_dir = g_strdup(disk_cache_dir);
+    pool->isolate = isolate;
+    // Recordings aren't kept for render processes
+    pool->record_budget = isolate ? 0 : record_budget;
+    pool->uri = g_strdup(uri);
+    pool->bytes = bytes ? g_bytes_ref(bytes) : NULL;
+    pool->doc_fd = isolate && bytes ? create_document_memfd(bytes) : -1;
+
+    for (int i = 0; i < SDL_max(pool->num_workers, 1); i++) {
+        struct bv_render_worker *worker = &pool->workers[i];
+        worker->pool = pool;
+        worker->sock = -1;
+        if (!isolate)
+            worker->document = load_document(uri, bytes);
+        if (!pool->num_workers)
+            break;
+        worker->thread = SDL_CreateThread(render_worker, "bv_render", worker);
+        expect(worker->thread);
+    }
+    return pool;
+}
+
+static struct bv_render_job *new_job(int page_index, int region, double scale,
+                                     double page_width, double page_height,
+                                     struct bv_texture *target,
+                                     unsigned char *pixels, int pitch) {
+    struct bv_render_job *job = malloc(sizeof(*job));
+    expect(job);
+    *job = (struct bv_render_job){
+        .page_index = page_index,
+        .region = region,
+        .antialias = CAIRO_ANTIALIAS_BEST,
+        .scale = scale,
+        .result = {.page_number = page_index,
+                   .region = region,
+                   .scale = scale,
+                   .page_width = page_width,
+                   .page_height = page_height},
+    };
+    struct bv_cache_entry *res = &job->result;
+    region_surface_size(page_width, page_height, scale, &res->img_width,
+                        &res->img_height);
+    if (target) {
+        res->cairo_surface = cairo_image_surface_create_for_data(
+            pixels, CAIRO_FORMAT_ARGB32, res->img_width, res->img_height,
+            pitch);
+        expect(cairo_surface_status(res->cairo_surface) ==
+               CAIRO_STATUS_SUCCESS);
+        job->target = target;
+    }
+    return job;
+}
+
+// Must be called with the pool lock held
+static struct bv_render_job *find_job(struct bv_render_pool *pool,
+                                      int page_index, int region,
+                                      double scale) {
+    for (struct bv_render_job *job = pool->jobs; job; job = job->next)
+        if (job->page_index == page_index && job->region == region &&
+            job->scale == scale && !job->cancelled && !job->pack &&
+            !job->store)
+            return job;
+    return NULL;
+}
+
+static int render_pool_has_job(struct bv_render_pool *pool, int page_index,
+                               int region, double scale) {
+    SDL_LockMutex(pool->lock);
+    int found = find_job(pool, page_index, region, scale) != NULL;
+    SDL_UnlockMutex(pool->lock);
+    return found;
+}
+
+static void render_pool_submit(struct bv_render_pool *pool,
+                               struct bv_render_job *job, int priority) {
+    SDL_LockMutex(pool->lock);
+    job->priority = priority;
+    job->next = pool->jobs;
+    pool->jobs = job;
+    SDL_CondBroadcast(pool->cond);
+    SDL_UnlockMutex(pool->lock);
+}
+
+// Queue a render, or move an existing one to priority. Lowest goes first.
+static void render_pool_request(struct bv_render_pool *pool, int page_index,
+                                int region, double scale, int preview,
+                                double page_width, double page_height,
+                                int priority) {
+    SDL_LockMutex(pool->lock);
+    struct bv_render_job *job = find_job(pool, page_index, region, scale);
+    if (!job) {
+        job = new_job(page_index, region, scale, page_width, page_height,
+                      NULL, NULL, 0);
+        job->preview = preview;
+        job->result.derived = preview;
+        job->next = pool->jobs;
+        pool->jobs = job;
+    }
+    job->priority = priority;
+    SDL_CondBroadcast(pool->cond);
+    SDL_UnlockMutex(pool->lock);
+}
+
+static void render_pool_pack(struct bv_render_pool *pool,
+                             struct bv_cache_entry *entry) {
+    struct bv_render_job *job =
+        new_job(entry->page_number, entry->region, entry->scale,
+                entry->page_width, entry->page_height, NULL, NULL, 0);
+    job->result = *entry;
+    job->result.prev = job->result.next = NULL;
+    job->pack = 1;
+    free(entry);
+    render_pool_submit(pool, job, PACK_PRIORITY);
+}
+
+static void render_pool_unpack(struct bv_render_pool *pool,
+                               const struct bv_cache_entry *packed,
+                               int priority) {
+    struct bv_render_job *job =
+        new_job(packed->page_number, packed->region, packed->scale,
+                packed->page_width, packed->page_height, NULL, NULL, 0);
+    job->result.derived = packed->derived;
+    job->unpack = malloc(packed->bytes);
+    expect(job->unpack);
+    memcpy(job->unpack, packed->packed, packed->bytes);
+    render_pool_submit(pool, job, priority);
+}
+
+// Write out a finished render, holding its surface until then
+static void render_pool_store(struct bv_render_pool *pool,
+                              const struct bv_cache_entry *entry) {
+    struct bv_render_job *job =
+        new_job(entry->page_number, entry->region, entry->scale,
+                entry->page_width, entry->page_height, NULL, NULL, 0);
+    job->result.cairo_surface = cairo_surface_reference(entry->cairo_surface);
+    job->store = 1;
+    render_pool_submit(pool, job, STORE_PRIORITY);
+}
+
+// Recording at the largest region's scale decodes images sharp enough for all
+static void render_pool_set_record_scale(struct bv_render_pool *pool,
+                                         double scale) {
+    SDL_LockMutex(pool->lock);
+    pool->record_scale = scale;
+    SDL_UnlockMutex(pool->lock);
+}
+
+// Render a page across the pool and wait for it, bypassing the event loop
+static struct bv_cache_entry
+render_pool_render_sync(struct bv_render_pool *pool, int page_index,
+                        int region, double scale, double page_width,
+                        double page_height) {
+    struct bv_render_job *job = new_job(page_index, region, scale, page_width,
+                                        page_height, NULL, NULL, 0);
+    job->sync = 1;
+
+    SDL_LockMutex(pool->lock);
+    job->next = pool->jobs;
+    pool->jobs = job;
+    SDL_CondBroadcast(pool->cond);
+    while (!job->done)
+        if (pool->num_workers || !render_next_band(&pool->workers[0]))
+            SDL_CondWait(pool->done_cond, pool->lock);
+    SDL_UnlockMutex(pool->lock);
+
+    struct bv_cache_entry result = job->result;
+    free(job);
+    return result;
+}
+
+// Bands already being rendered can't be stopped, so those jobs are only
+// marked cancelled and discarded by handle_render_done()
+static void render_pool_cancel_stale(struct bv_render_pool *pool,
+                                     const unsigned char *wanted,
+                                     const double region_scale[]) {
+    SDL_LockMutex(pool->lock);
+    struct bv_render_job **pp = &pool->jobs;
+    while (*pp) {
+        struct bv_render_job *job = *pp;
+        // Pages are compressed and stored outside the window too
+        int stale =
+            !job->thumbnail &&
+            ((!job->pack && !job->store && !wanted[job->page_index]) ||
+             job->scale != job_scale(region_scale[job->region], job->preview));
+        if (stale && job->rows_done == job->next_row) {
+            *pp = job->next;
+            free_job(job);
+            continue;
+        }
+        if (stale)
+            job->cancelled = 1;
+        pp = &job->next;
+    }
+    SDL_UnlockMutex(pool->lock);
+}
+
+static void free_done_jobs(void) {
+    SDL_Event event;
+    while (SDL_PeepEvents(&event, 1, SDL_GETEVENT, render_done_event,
+                          render_done_event) == 1)
+        free_job(event.user.data1);
+}
+
+// Waits for the workers and frees everything but the jobs, which may hold
+// locked textures and so are left to the main thread
+static void render_pool_stop(struct bv_render_pool *pool) {
+    SDL_LockMutex(pool->lock);
+    pool->quit = 1;
+    SDL_CondBroadcast(pool->cond);
+    SDL_UnlockMutex(pool->lock);
+
+    for (int i = 0; i < SDL_max(pool->num_workers, 1); i++) {
+        SDL_WaitThread(pool->workers[i].thread, NULL);
+        if (pool->workers[i].document)
+            g_object_unref(pool->workers[i].document);
+        farm_kill(&pool->workers[i]);
+    }
+    if (pool->doc_fd >= 0)
+        close(pool->doc_fd);
+    while (pool->recordings) {
+        struct bv_recording *rec = pool->recordings;
+        pool->recordings = rec->next;
+        free_recording(rec);
+    }
+}
+
+static void render_pool_free(struct bv_render_pool *pool) {
+    SDL_DestroyCond(pool->record_cond);
+    SDL_DestroyCond(pool->done_cond);
+    SDL_DestroyCond(pool->cond);
+    SDL_DestroyMutex(pool->lock);
+    if (pool->bytes)
+        g_bytes_unref(pool->bytes);
+    g_free(pool->uri);
+    g_free(pool->disk_cache_dir);
+    free(pool);
+}
+
+static void render_pool_destroy(struct bv_render_pool *pool) {
+    render_pool_stop(pool);
+    while (pool->jobs) {
+        struct bv_render_job *job = pool->jobs;
+        pool->jobs = job->next;
+        free_job(job);
+    }
+    free_done_jobs();
+    render_pool_free(pool);
+}
+
+static int render_pool_reap(void *data) {
+    struct bv_render_pool *pool = data;
+    render_pool_stop(pool);
+    if (pool->remove_disk_cache)
+        remove_disk_cache_dir(pool->disk_cache_dir);
+    render_pool_free(pool);
+    return 0;
+}
+
+// Cancelled jobs in flight still come back to handle_render_done(), while a
+// detached thread joins the workers and removes the old disk cache
+static void render_pool_retire(struct bv_render_pool *pool,
+                               int remove_disk_cache) {
+    SDL_LockMutex(pool->lock);
+    pool->quit = 1;
+    pool->remove_disk_cache = remove_disk_cache && pool->disk_cache_dir;
+    struct bv_render_job **pp = &pool->jobs;
+    while (*pp) {
+        struct bv_render_job *job = *pp;
+        if (job->rows_done == job->next_row) {
+            *pp = job->next;
+            free_job(job);
+            continue;
+        }
+        job->cancelled = 1;
+        pp = &job->next;
+    }
+    SDL_CondBroadcast(pool->cond);
+    SDL_UnlockMutex(pool->lock);
+    free_done_jobs();
+
+    SDL_Thread *thread = SDL_CreateThread(render_pool_reap, "bv_reap", pool);
+    expect(thread);
+    SDL_DetachThread(thread);
+}
+
+static void ensure_texture(struct bv_texture *texdata, SDL_Renderer *renderer,
+                           SDL_PixelFormatEnum pixel_fmt, int width,
+                           int height) {
+    if (texdata->texture == NULL || texdata->natural_width != width ||
+        texdata->natural_height != height) {
+        if (texdata->texture)
+            SDL_DestroyTexture(texdata->texture);
+        texdata->texture = SDL_CreateTexture(
+            renderer, pixel_fmt, SDL_TEXTUREACCESS_STREAMING, width, height);
+        expect(texdata->texture);
+        texdata->natural_width = width;
+        texdata->natural_height = height;
+        texdata->page_number = page_number_invalid;
+    }
+}
+
+static int find_texture(struct bv_sdl_ctx *ctx, int page_index, double scale) {
+    for (int i = 0; i < NUM_TEXTURES; i++) {
+        struct bv_texture *texdata = &ctx->textures[i];
+        if (texdata->texture && !texdata->locked &&
+            texdata->page_number == page_index &&
+            (scale == scale_any || texdata->scale == scale))
+            return i;
+    }
+    return -1;
+}
+
+// Falls back to the front texture if all others are being rendered into.
+// Empty and stale textures go first, then the furthest page.
+static int spare_texture(struct bv_sdl_ctx *ctx, int current_page,
+                         double scale) {
+    int best = ctx->front, best_score = -1;
+    for (int i = 0; i < NUM_TEXTURES; i++) {
+        struct bv_texture *texdata = &ctx->textures[i];
+        if (i == ctx->front || texdata->locked)
+            continue;
+        int score = texdata->page_number == page_number_invalid ? INT_MAX
+                    : texdata->scale != scale
+                        ? INT_MAX - 1
+                        : abs(texdata->page_number - current_page);
+        if (score > best_score) {
+            best = i;
+            best_score = score;
+        }
+    }
+    return best;
+}
+
+// The page whose renders stand in for page_index, see page_alias
+static int page_key(const struct bv_prog_state *state, int page_index) {
+    if (!state->page_alias || page_index < 0 || page_index >= state->num_pages)
+        return page_index;
+    return state->page_alias[page_index];
+}
+
+static struct bv_sdl_ctx *region_ctx(struct bv_prog_state *state, int region) {
+    for (int i = 0; i < NUM_CTX; i++)
+        if (state->ctx[i].region_index == region)
+            return &state->ctx[i];
+    expect(0);
+    return NULL;
+}
+
+static int region_is_derived(struct bv_prog_state *state, int page_index,
+                             int region) {
+    double scale = state->region_scale[region];
+    struct bv_cache_entry *entry =
+        cache_lookup(&state->page_cache, page_index, region, scale);
+    if (entry)
+        return entry->derived;
+    struct bv_sdl_ctx *ctx = region_ctx(state, region);
+    int idx = find_texture(ctx, page_index, scale);
+    return idx >= 0 && ctx->textures[idx].derived;
+}
+
+static void drop_derived(struct bv_prog_state *state, int page_index,
+                         int region, double scale) {
+    struct bv_cache_entry *entry =
+        cache_lookup(&state->page_cache, page_index, region, scale);
+    if (entry && entry->derived)
+        cache_remove(&state->page_cache, entry);
+    entry = cache_lookup(&state->cold_cache, page_index, region, scale);
+    if (entry && entry->derived)
+        cache_remove(&state->cold_cache, entry);
+    struct bv_sdl_ctx *ctx = region_ctx(state, region);
+    int idx = find_texture(ctx, page_index, scale);
+    if (idx >= 0 && ctx->textures[idx].derived)
+        ctx->textures[idx].page_number = page_number_invalid;
+}
+
+static int region_is_resident(struct bv_prog_state *state, int page_index,
+                              int region) {
+    double scale = state->region_scale[region];
+    return cache_lookup(&state->page_cache, page_index, region, scale) ||
+           find_texture(region_ctx(state, region), page_index, scale) >= 0;
+}
+
+static int load_region_from_disk(struct bv_prog_state *state, int page_index,
+                                 int region, double page_width,
+                                 double page_height) {
+    if (!state->disk_cache_dir)
+        return 0;
+
+    struct bv_cache_entry entry = {.page_number = page_index,
+                                   .region = region,
+                                   .scale = state->region_scale[region],
+                                   .page_width = page_width,
+                                   .page_height = page_height};
+    region_surface_size(page_width, page_height, entry.scale,
+                        &entry.img_width, &entry.img_height);
+    entry.cairo_surface =
+        disk_cache_load(state->disk_cache_dir, page_index, region,
+                        entry.img_width, entry.img_height);
+    if (!entry.cairo_surface)
+        return 0;
+
+    cache_drop_other_scales(&state->page_cache, page_index, region,
+                            entry.scale);
+    cache_insert(&state->page_cache, &entry);
+    cache_evict(&state->page_cache, page_key(state, state->current_page),
+                state->region_scale);
+    return 1;
+}
+
+// Only priority 0, the page being waited on, is decompressed here
+static int restore_region(struct bv_prog_state *state, int page_index,
+                          int region, int priority) {
+    double scale = state->region_scale[region];
+    struct bv_cache_entry *packed =
+        cache_lookup(&state->cold_cache, page_index, region, scale);
+    if (!packed)
+        return 0;
+    if (priority > 0) {
+        if (!render_pool_has_job(state->pool, page_index, region, scale))
+            render_pool_unpack(state->pool, packed, priority);
+        return 1;
+    }
+
+    struct bv_cache_entry entry = *packed;
+    entry.packed = NULL;
+    entry.cairo_surface = cairo_image_surface_create(
+        CAIRO_FORMAT_ARGB32, entry.img_width, entry.img_height);
+    expect(cairo_surface_status(entry.cairo_surface) == CAIRO_STATUS_SUCCESS);
+    unpack_surface(packed->packed, entry.cairo_surface);
+    cache_insert(&state->page_cache, &entry);
+    cache_evict(&state->page_cache, page_key(state, state->current_page),
+                state->region_scale);
+    return 1;
+}
+
+static void load_stored_page(struct bv_prog_state *state, int page_index) {
+    page_index = page_key(state, page_index);
+    double page_width, page_height;
+    get_page_size(state->document, page_index, &page_width, &page_height);
+    for (int r = 0; r < NUM_CTX; r++)
+        if (!region_is_resident(state, page_index, r) &&
+            !restore_region(state, page_index, r, 0))
+            load_region_from_disk(state, page_index, r, page_width,
+                                  page_height);
+}
+
+static int page_is_cached(struct bv_prog_state *state, int page_index) {
+    page_index = page_key(state, page_index);
+    for (int r = 0; r < NUM_CTX; r++)
+        if (!region_is_resident(state, page_index, r))
+            return 0;
+    return 1;
+}
+
+// Returns 0 if no spare texture can take the render
+static int request_into_texture(struct bv_prog_state *state, int page_index,
+                                int region, double page_width,
+                                double page_height) {
+    // Render processes can't reach texture memory
+    if (state->pool->isolate)
+        return 0;
+    struct bv_sdl_ctx *ctx = region_ctx(state, region);
+    double scale = state->region_scale[region];
+    int idx = spare_texture(ctx, page_key(state, state->current_page), scale);
+    if (idx == ctx->front)
+        return 0;
+
+    int img_width, img_height;
+    region_surface_size(page_width, page_height, scale, &img_width,
+                        &img_height);
+    struct bv_texture *texdata = &ctx->textures[idx];
+    ensure_texture(texdata, ctx->renderer, SDL_PIXELFORMAT_ARGB8888,
+                   img_width, img_height);
+
+    void *pixels;
+    int pitch;
+    if (SDL_LockTexture(texdata->texture, NULL, &pixels, &pitch) != 0)
+        return 0;
+    if (pitch % 4 ||
+        pitch < cairo_format_stride_for_width(CAIRO_FORMAT_ARGB32, img_width)) {
+        SDL_UnlockTexture(texdata->texture);
+        return 0;
+    }
+    texdata->locked = 1;
+    texdata->derived = 0;
+    texdata->page_number = page_index;
+    texdata->scale = scale;
+
+    struct bv_render_job *job = new_job(page_index, region, scale, page_width,
+                                        page_height, texdata, pixels, pitch);
+    job->recache = state->disk_cache_dir ||
+                   (!state->drop_uploaded &&
+                    (size_t)pitch * img_height <= state->page_cache.budget);
+    render_pool_submit(state->pool, job, 0);
+    return 1;
+}
+
+// Stand-ins aren't shrunk, since the result would pass for a proper render
+static int request_downscale(struct bv_prog_state *state, int page_index,
+                             int region, double page_width,
+                             double page_height, int priority) {
+    double scale = state->region_scale[region];
+    if (render_pool_has_job(state->pool, page_index, region, scale))
+        return 0;
+    struct bv_cache_entry *src = NULL;
+    for (struct bv_cache_entry *e = state->page_cache.head; e; e = e->next)
+        if (e->page_number == page_index && e->region == region &&
+            !e->derived && e->scale > scale && (!src || e->scale < src->scale))
+            src = e;
+    if (!src)
+        return 0;
+
+    struct bv_render_job *job = new_job(page_index, region, scale, page_width,
+                                        page_height, NULL, NULL, 0);
+    job->source = cairo_surface_reference(src->cairo_surface);
+    job->result.derived = scale / src->scale > DOWNSCALE_SHARP_RATIO;
+    render_pool_submit(state->pool, job, priority);
+    return 1;
+}
+
+// 0 means full quality. Modes not yet tried get the benefit of the doubt.
+static int draft_mode(struct bv_prog_state *state, int page_index,
+                      int region) {
+    const double *ms = state->render_cost[page_index].ms[region];
+    double budget = state->render_budget_ms;
+    if (!budget || ms[0] <= budget)
+        return 0;
+    for (int mode = 1; mode < NUM_AA_MODES; mode++)
+        if (!ms[mode] ||
+            (ms[mode] <= budget && ms[mode] <= ms[0] * DRAFT_MAX_COST))
+            return mode;
+    return 0;
+}
+
+// Returns 0 if the region fits in --render-budget-ms as it is
+static int request_draft(struct bv_prog_state *state, int page_index,
+                         int region, double page_width, double page_height,
+                         int priority) {
+    int mode = draft_mode(state, page_index, region);
+    if (!mode)
+        return 0;
+    double scale = state->region_scale[region];
+    if (render_pool_has_job(state->pool, page_index, region, scale)) {
+        render_pool_request(state->pool, page_index, region, scale, 0,
+                            page_width, page_height, priority);
+        return 1;
+    }
+
+    struct bv_render_job *job = new_job(page_index, region, scale, page_width,
+                                        page_height, NULL, NULL, 0);
+    job->antialias = antialias_modes[mode];
+    job->result.derived = 1;
+    render_pool_submit(state->pool, job, priority);
+    return 1;
+}
+
+static void request_page(struct bv_prog_state *state, int page_index,
+                         int priority) {
+    if (page_index < 0 || page_index >= state->num_pages)
+        return;
+    page_index = page_key(state, page_index);
+    double page_width, page_height;
+    get_page_size(state->document, page_index, &page_width, &page_height);
+    for (int r = 0; r < NUM_CTX; r++) {
+        double scale = state->region_scale[r];
+        if (region_is_derived(state, page_index, r)) {
+            // The page on screen is refined ahead of any prefetch
+            int refine = page_index == page_key(state, state->current_page)
+                             ? priority
+                             : priority + REFINE_PRIORITY;
+            render_pool_request(state->pool, page_index, r, scale, 0,
+                                page_width, page_height, refine);
+            continue;
+        }
+        if (region_is_resident(state, page_index, r) ||
+            restore_region(state, page_index, r, priority) ||
+            load_region_from_disk(state, page_index, r, page_width,
+                                  page_height) ||
+            request_downscale(state, page_index, r, page_width, page_height,
+                              priority) ||
+            request_draft(state, page_index, r, page_width, page_height,
+                          priority))
+            continue;
+        if (page_index == page_key(state, state->current_page)) {
+            double pscale = job_scale(scale, 1);
+            if (state->progressive &&
+                !cache_lookup(&state->page_cache, page_index, r, pscale) &&
+                find_texture(region_ctx(state, r), page_index, pscale) < 0)
+                render_pool_request(state->pool, page_index, r, pscale, 1,
+                                    page_width, page_height, -1);
+            if (!render_pool_has_job(state->pool, page_index, r, scale) &&
+                request_into_texture(state, page_index, r, page_width,
+                                     page_height))
+                continue;
+        }
+        render_pool_request(state->pool, page_index, r, scale, 0, page_width,
+                            page_height, priority);
+    }
+}
+
+// Only bands of rows which differ from old are uploaded, merged if closer
+// than DIRTY_MERGE_ROWS since each upload has a fixed cost
+static void upload_dirty(SDL_Texture *texture, cairo_surface_t *old,
+                         cairo_surface_t *new) {
+    int width = cairo_image_surface_get_width(new);
+    int height = cairo_image_surface_get_height(new);
+    int old_stride = cairo_image_surface_get_stride(old);
+    int new_stride = cairo_image_surface_get_stride(new);
+    const unsigned char *old_data = cairo_image_surface_get_data(old);
+    const unsigned char *new_data = cairo_image_surface_get_data(new);
+    expect(old_data && new_data);
+
+    SDL_Rect band = {0};
+    int gap = 0;
+    for (int y = 0; y <= height; y++) {
+        int first = width, last = -1;
+        if (y < height) {
+            const uint32_t *a =
+                (const uint32_t *)(old_data + (size_t)y * old_stride);
+            const uint32_t *b =
+                (const uint32_t *)(new_data + (size_t)y * new_stride);
+            first = first_diff(a, b, width);
+            if (first < width)
+                last = last_diff(a, b, width);
+        }
+        if (first < width && band.h) {
+            int right = SDL_max(band.x + band.w, last + 1);
+            band.x = SDL_min(band.x, first);
+            band.w = right - band.x;
+            band.h = y - band.y + 1;
+            gap = 0;
+        } else if (first < width) {
+            band = (SDL_Rect){first, y, last - first + 1, 1};
+            gap = 0;
+        } else if (band.h && (++gap > DIRTY_MERGE_ROWS || y == height)) {
+            expect(SDL_UpdateTexture(texture, &band,
+                                     new_data + (size_t)band.y * new_stride +
+                                         (size_t)band.x * 4,
+                                     new_stride) == 0);
+            band.h = 0;
+        }
+    }
+}
+
+// If prev is given, it's what the texture already holds
+static void update_texture_for_context(struct bv_sdl_ctx *ctx, int idx,
+                                       struct bv_cache_entry *entry,
+                                       const struct bv_cache_entry *prev) {
+    expect(entry->region == ctx->region_index);
+    SDL_Renderer *renderer = ctx->renderer;
+    struct bv_texture *texdata = &ctx->textures[idx];
+    expect(!texdata->locked);
+    ensure_texture(texdata, renderer, SDL_PIXELFORMAT_ARGB8888,
+                   entry->img_width, entry->img_height);
+    texdata->page_number = entry->page_number;
+    texdata->scale = entry->scale;
+    texdata->derived = entry->derived;
+
+    if (prev) {
+        upload_dirty(texdata->texture, prev->cairo_surface,
+                     entry->cairo_surface);
+        return;
+    }
+    int cairo_stride = cairo_image_surface_get_stride(entry->cairo_surface);
+    unsigned char *cairo_data =
+        cairo_image_surface_get_data(entry->cairo_surface);
+    expect(cairo_data);
+    expect(SDL_UpdateTexture(texdata->texture, NULL, cairo_data,
+                             cairo_stride) == 0);
+}
+
+// With --drop-uploaded the texture becomes the only copy
+static void upload_entry(struct bv_prog_state *state, struct bv_sdl_ctx *ctx,
+                         int idx, struct bv_cache_entry *entry) {
+    struct bv_texture *texdata = &ctx->textures[idx];
+    struct bv_cache_entry *prev = NULL;
+    if (texdata->texture && texdata->page_number != page_number_invalid &&
+        texdata->natural_width == entry->img_width &&
+        texdata->natural_height == entry->img_height)
+        prev = cache_peek(&state->page_cache, texdata->page_number,
+                          ctx->region_index, texdata->scale);
+    if (prev && (prev->img_width != entry->img_width ||
+                 prev->img_height != entry->img_height))
+        prev = NULL;
+    update_texture_for_context(ctx, idx, entry, prev);
+    if (state->drop_uploaded)
+        cache_remove(&state->page_cache, entry);
+}
+
+static void upload_neighbours(struct bv_prog_state *state) {
+    for (int i = 0; i < NUM_CTX; i++) {
+        struct bv_sdl_ctx *ctx = &state->ctx[i];
+        double scale = state->region_scale[ctx->region_index];
+        // Ahead first, since that's where we're most likely to go
+        for (int behind = 0; behind < 2; behind++) {
+            int offset = behind ? -state->prefetch.direction
+                                : state->prefetch.direction;
+            int page_index = state->current_page + offset;
+            if (page_index < 0 || page_index >= state->num_pages)
+                continue;
+            page_index = page_key(state, page_index);
+            if (find_texture(ctx, page_index, scale) >= 0)
+                continue;
+            struct bv_cache_entry *entry = cache_lookup(
+                &state->page_cache, page_index, ctx->region_index, scale);
+            if (!entry)
+                continue;
+            int idx = spare_texture(ctx, page_key(state, state->current_page),
+                                    scale);
+            if (idx == ctx->front)
+                break;
+            upload_entry(state, ctx, idx, entry);
+        }
+    }
+}
+
+static size_t page_bytes(struct bv_prog_state *state, int page_index) {
+    double page_width, page_height;
+    get_page_size(state->document, page_index, &page_width, &page_height);
+    size_t bytes = 0;
+    for (int r = 0; r < NUM_CTX; r++) {
+        int width, height;
+        region_surface_size(page_width, page_height, state->region_scale[r],
+                            &width, &height);
+        bytes += (size_t)cairo_format_stride_for_width(CAIRO_FORMAT_ARGB32,
+                                                       width) *
+                 height;
+    }
+    return bytes;
+}
+
+// Never further than the cache budget holds, giving up pages behind first
+static void prefetch_depth(struct bv_prog_state *state, int *ahead,
+                           int *behind) {
+    const struct bv_prefetch *pf = &state->prefetch;
+    *ahead = pf->fast ? pf->ahead * 2 : pf->ahead;
+    *behind = pf->behind;
+
+    size_t per_page = page_bytes(state, state->current_page);
+    size_t fits = per_page ? state->page_cache.budget / per_page : 0;
+    while ((size_t)(*ahead + *behind + 1) > fits && *ahead + *behind > 0) {
+        if (*behind > 0)
+            (*behind)--;
+        else
+            (*ahead)--;
+    }
+}
+
+static void idle_update_cache(struct bv_prog_state *state) {
+    int ahead, behind;
+    prefetch_depth(state, &ahead, &behind);
+    int dir = state->prefetch.direction, cur = state->current_page;
+    int first = dir > 0 ? cur - behind : cur - ahead;
+    int last = dir > 0 ? cur + ahead : cur + behind;
+    // Duplicates are rendered as the first of them, which may be anywhere
+    unsigned char *wanted = g_new0(unsigned char, state->num_pages);
+    for (int i = SDL_max(first, 0); i <= SDL_min(last, state->num_pages - 1);
+         i++)
+        wanted[page_key(state, i)] = 1;
+    render_pool_cancel_stale(state->pool, wanted, state->region_scale);
+    g_free(wanted);
+
+    // Interleave so the immediate neighbours come first either way
+    request_page(state, cur, 0);
+    for (int i = 1; i <= ahead || i <= behind; i++) {
+        if (i <= ahead)
+            request_page(state, cur + dir * i, 2 * i - 1);
+        if (i <= behind)
+            request_page(state, cur - dir * i, 2 * i);
+    }
+    upload_neighbours(state);
+    state->needs_cache = 0;
+}
+
+static void overview_upload(struct bv_prog_state *state, int page_index,
+                            cairo_surface_t *thumb) {
+    struct bv_overview *ov = &state->overview;
+    // Rounding up in region_surface_size() may leave us a pixel over
+    SDL_Rect cell = {
+        page_index % ov->cols * ov->cell_width,
+        page_index / ov->cols * ov->cell_height,
+        SDL_min(cairo_image_surface_get_width(thumb), ov->cell_width),
+        SDL_min(cairo_image_surface_get_height(thumb), ov->cell_height)};
+    expect(SDL_UpdateTexture(ov->atlas, &cell,
+                             cairo_image_surface_get_data(thumb),
+                             cairo_image_surface_get_stride(thumb)) == 0);
+    if (ov->active)
+        state->needs_redraw = 1;
+}
+
+// Cells are sized as shown in the presenter window, within THUMB_FRACTION
+// of the slide and the renderer's texture limits
+static void init_overview(struct bv_prog_state *state) {
+    struct bv_overview *ov = &state->overview;
+    struct bv_sdl_ctx *ctx = region_ctx(state, PRESENTER_REGION);
+    double page_width, page_height;
+    get_page_size(state->document, 0, &page_width, &page_height);
+
+    double thumb_scale = state->region_scale[SLIDE_REGION] * THUMB_FRACTION;
+    double cell_width = page_width / NUM_CTX * thumb_scale;
+    double cell_height = page_height * thumb_scale;
+    int win_width, win_height;
+    SDL_GetRendererOutputSize(ctx->renderer, &win_width, &win_height);
+    ov->cols = (int)ceil(sqrt(state->num_pages * (double)win_width *
+                              cell_height / (win_height * cell_width)));
+    if (ov->cols < 1)
+        ov->cols = 1;
+    if (ov->cols > state->num_pages)
+        ov->cols = state->num_pages;
+    ov->rows = (state->num_pages + ov->cols - 1) / ov->cols;
+
+    SDL_RendererInfo info;
+    expect(SDL_GetRendererInfo(ctx->renderer, &info) == 0);
+    double fit = fmin(1.0, fmin(win_width / (ov->cols * cell_width),
+                                win_height / (ov->rows * cell_height)));
+    if (info.max_texture_width)
+        fit = fmin(fit, info.max_texture_width / (ov->cols * cell_width));
+    if (info.max_texture_height)
+        fit = fmin(fit, info.max_texture_height / (ov->rows * cell_height));
+    ov->cell_width = (int)fmax(1, cell_width * fit);
+    ov->cell_height = (int)fmax(1, cell_height * fit);
+
+    int atlas_width = ov->cols * ov->cell_width;
+    int atlas_height = ov->rows * ov->cell_height;
+    ov->atlas = SDL_CreateTexture(ctx->renderer, SDL_PIXELFORMAT_ARGB8888,
+                                  SDL_TEXTUREACCESS_STATIC, atlas_width,
+                                  atlas_height);
+    expect(ov->atlas);
+    // Cleared a row of cells at a time, so the blank buffer stays small
+    void *blank = calloc((size_t)atlas_width * ov->cell_height, 4);
+    expect(blank);
+    for (int row = 0; row < ov->rows; row++) {
+        SDL_Rect band = {0, row * ov->cell_height, atlas_width,
+                         ov->cell_height};
+        expect(SDL_UpdateTexture(ov->atlas, &band, blank, atlas_width * 4) ==
+               0);
+    }
+    free(blank);
+
+    for (int i = 0; i < state->num_pages; i++) {
+        get_page_size(state->document, i, &page_width, &page_height);
+        double scale = fmin(ov->cell_width / (page_width / NUM_CTX),
+                            ov->cell_height / page_height);
+        struct bv_render_job *job =
+            new_job(i, SLIDE_REGION, scale, page_width, page_height, NULL,
+                    NULL, 0);
+        cairo_surface_t *thumb = ov->thumbs[i];
+        if (thumb &&
+            cairo_image_surface_get_width(thumb) == job->result.img_width &&
+            cairo_image_surface_get_height(thumb) == job->result.img_height) {
+            overview_upload(state, i, thumb);
+            free_job(job);
+            continue;
+        }
+        cairo_surface_destroy(thumb);
+        ov->thumbs[i] = NULL;
+        job->thumbnail = 1;
+        render_pool_submit(state->pool, job, THUMB_PRIORITY + i);
+    }
+}
+
+// Where the atlas is drawn in the presenter window, in renderer pixels
+static SDL_Rect overview_rect(struct bv_sdl_ctx *ctx,
+                              const struct bv_overview *ov) {
+    int win_width, win_height;
+    SDL_GetRendererOutputSize(ctx->renderer, &win_width, &win_height);
+    int atlas_width = ov->cols * ov->cell_width;
+    int atlas_height = ov->rows * ov->cell_height;
+    double scale = fmin((double)win_width / atlas_width,
+                        (double)win_height / atlas_height);
+    int width = (int)(atlas_width * scale);
+    int height = (int)(atlas_height * scale);
+    return (SDL_Rect){(win_width - width) / 2, (win_height - height) / 2, width,
+                      height};
+}
+
+static void draw_overview(struct bv_prog_state *state,
+                          struct bv_sdl_ctx *ctx) {
+    const struct bv_overview *ov = &state->overview;
+    SDL_Rect dst = overview_rect(ctx, ov);
+    SDL_SetRenderDrawColor(ctx->renderer, 0, 0, 0, 255);
+    SDL_RenderClear(ctx->renderer);
+    SDL_RenderCopy(ctx->renderer, ov->atlas, NULL, &dst);
+
+    double cell_width = (double)dst.w / ov->cols;
+    double cell_height = (double)dst.h / ov->rows;
+    SDL_Rect sel = {dst.x + (int)(ov->selected % ov->cols * cell_width),
+                    dst.y + (int)(ov->selected / ov->cols * cell_height),
+                    (int)cell_width, (int)cell_height};
+    SDL_SetRenderDrawColor(ctx->renderer, 255, 200, 0, 255);
+    for (int i = 0; i < 3 && sel.w > 0 && sel.h > 0; i++) {
+        SDL_RenderDrawRect(ctx->renderer, &sel);
+        sel = (SDL_Rect){sel.x + 1, sel.y + 1, sel.w - 2, sel.h - 2};
+    }
+    SDL_RenderPresent(ctx->renderer);
+}
+
+static void record_render_cost(struct bv_prog_state *state,
+                               const struct bv_render_job *job) {
+    for (int m = 0; m < NUM_AA_MODES; m++)
+        if (antialias_modes[m] == job->antialias)
+            state->render_cost[job->page_index].ms[job->region][m] =
+                job->render_ms;
+}
+
+static void render_cost_report(const struct bv_prog_state *state) {
+    if (!state->render_budget_ms)
+        return;
+    int over = 0, slowest = 0;
+    double slowest_ms = 0;
+    for (int i = 0; i < state->num_pages; i++) {
+        double ms = 0;
+        for (int r = 0; r < NUM_CTX; r++)
+            ms = SDL_max(ms, state->render_cost[i].ms[r][0]);
+        over += ms > state->render_budget_ms;
+        if (ms > slowest_ms) {
+            slowest = i;
+            slowest_ms = ms;
+        }
+    }
+    fprintf(stderr, "Render budget: %d of %d pages over %d ms", over,
+            state->num_pages, state->render_budget_ms);
+    if (over)
+        fprintf(stderr, ", slowest is page %d at %.1f ms", slowest,
+                slowest_ms);
+    fputc('\n', stderr);
+}
+
+// Evicted entries join the compressed tier unless stale or already there
+static void finish_spill(struct bv_prog_state *state,
+                         struct bv_render_job *job) {
+    struct bv_page_cache *cold = &state->cold_cache;
+    struct bv_cache_entry *res = &job->result;
+    if (job->cancelled) {
+        free_job(job);
+        return;
+    }
+    // Pages may have been found to be duplicates meanwhile, see rekey_pages()
+    res->page_number = page_key(state, res->page_number);
+    if (res->scale != state->region_scale[res->region] ||
+        cache_peek(cold, res->page_number, res->region, res->scale)) {
+        free_job(job);
+        return;
+    }
+
+    struct bv_cache_entry *entry = malloc(sizeof(*entry));
+    expect(entry);
+    cairo_surface_destroy(res->cairo_surface);
+    *entry = *res;
+    entry->cairo_surface = NULL;
+    free(job);
+    cold->bytes += entry->bytes;
+    cache_push_head(cold, entry);
+    cache_evict(cold, page_number_invalid, state->region_scale);
+}
+
+static void handle_render_done(struct bv_render_job *job,
+                               struct bv_prog_state *state) {
+    if (job->thumbnail) {
+        if (!job->cancelled) {
+            cairo_surface_t *thumb = job->result.cairo_surface;
+            overview_upload(state, job->page_index, thumb);
+            cairo_surface_destroy(state->overview.thumbs[job->page_index]);
+            state->overview.thumbs[job->page_index] = thumb;
+            job->result.cairo_surface = NULL;
+        }
+        free_job(job);
+        return;
+    }
+
+    if (job->pack) {
+        finish_spill(state, job);
+        return;
+    }
+
+    if (job->store) {
+        free_job(job);
+        return;
+    }
+
+    if (job->cancelled ||
+        job->scale !=
+            job_scale(state->region_scale[job->region], job->preview)) {
+        free_job(job);
+        return;
+    }
 
-    slot->page_number = page_index;
-    g_object_unref(page);
+    if (!job->preview && job->render_ms > 0)
+        record_render_cost(state, job);
 
-    return CACHE_UPDATED;
-}
+    // The pixels are gone once unlocked, so the cache gets its own render
+    // after the prefetches
+    if (job->target) {
+        unlock_texture(job->target);
+        job->target = NULL;
+        if (job->recache)
+            render_pool_request(state->pool, job->page_index, job->region,
+                                job->scale, 0, job->result.page_width,
+                                job->result.page_height, REFINE_PRIORITY);
+        if (job->page_index == page_key(state, state->current_page))
+            state->needs_redraw = 1;
+        free_job(job);
+        return;
+    }
 
-static void idle_update_cache(struct bv_prog_state *state) {
-    if (state->current_page > 0)
-        page_cache_update(state, state->current_page - 1);
-    if (state->current_page < state->num_pages - 1)
-        page_cache_update(state, state->current_page + 1);
-    state->needs_cache = 0;
+    if (!job->preview)
+        cache_drop_other_scales(&state->page_cache, job->page_index,
+                                job->region, job->scale);
+    if (!job->result.derived)
+        drop_derived(state, job->page_index, job->region, job->scale);
+    if (state->disk_cache_dir && !job->preview && !job->unpack &&
+        !job->failed && !job->result.derived)
+        render_pool_store(state->pool, &job->result);
+    cache_insert(&state->page_cache, &job->result);
+    cache_evict(&state->page_cache, page_key(state, state->current_page),
+                state->region_scale);
+    if (job->page_index == page_key(state, state->current_page))
+        state->needs_redraw = 1;
+    else
+        upload_neighbours(state);
+    free(job->unpack);
+    free(job);
 }
 
 static int accel_x11_error_handler(Display *dpy, XErrorEvent *event) {
@@ -167,7 +2887,11 @@ static int accel_x11_error_handler(Display *dpy, XErrorEvent *event) {
     return 0;
 }
 
-static SDL_Renderer *create_renderer_with_fallback(SDL_Window *window) {
+static SDL_Renderer *create_renderer_with_fallback(SDL_Window *window,
+                                                   int software) {
+    if (software)
+        return SDL_CreateRenderer(window, -1, SDL_RENDERER_SOFTWARE);
+
     int (*old_handler)(Display *, XErrorEvent *) =
         XSetErrorHandler(accel_x11_error_handler); // Avoid BadValue crash
     SDL_Renderer *renderer = SDL_CreateRenderer(
@@ -182,7 +2906,8 @@ static SDL_Renderer *create_renderer_with_fallback(SDL_Window *window) {
     return renderer;
 }
 
-static void create_contexts(struct bv_sdl_ctx ctx[], int num_ctx) {
+static void create_contexts(struct bv_sdl_ctx ctx[], int num_ctx,
+                            int software) {
     SDL_Rect display_bounds;
     expect(SDL_GetDisplayBounds(0, &display_bounds) == 0);
     const int win_width = 1280;
@@ -199,82 +2924,459 @@ static void create_contexts(struct bv_sdl_ctx ctx[], int num_ctx) {
         expect(ctx[i].window);
         ctx[i].region_index = i;
         SDL_SetWindowData(ctx[i].window, BV_CTX, &ctx[i]);
-        ctx[i].renderer = create_renderer_with_fallback(ctx[i].window);
+        ctx[i].renderer =
+            create_renderer_with_fallback(ctx[i].window, software);
         expect(ctx[i].renderer);
     }
 }
 
-static void open_document(struct bv_prog_state *state, const char *pdf_file) {
+// Faulted in up front, so renders never stall on slow media
+static GBytes *map_document(const char *path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    die_on(fd < 0, "Couldn't open %s: %s\n", path, strerror(errno));
+    struct stat st;
+    expect(fstat(fd, &st) == 0);
+    die_on(st.st_size == 0, "PDF is empty\n");
+
+#ifdef POSIX_FADV_WILLNEED
+    posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+#endif
+#ifdef MAP_POPULATE
+    int populate = MAP_POPULATE;
+#else
+    int populate = 0;
+#endif
+    void *addr =
+        mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE | populate, fd, 0);
+    close(fd);
+    die_on(addr == MAP_FAILED, "Couldn't map %s: %s\n", path,
+           strerror(errno));
+#ifndef MAP_POPULATE
+    long page_size = sysconf(_SC_PAGESIZE);
+    volatile const char *bytes = addr;
+    for (off_t i = 0; i < st.st_size; i += page_size)
+        (void)bytes[i];
+#endif
+
+    struct bv_mapping *mapping = malloc(sizeof(*mapping));
+    expect(mapping);
+    *mapping = (struct bv_mapping){addr, st.st_size};
+    return g_bytes_new_with_free_func(addr, st.st_size, free_mapping, mapping);
+}
+
+// When watching, the PDF is copied into memory, so a rebuild can't leave
+// the workers and the watcher on different versions
+static void open_document(struct bv_prog_state *state, const char *pdf_file,
+                          int watch, int preload) {
     char resolved_path[PATH_MAX];
     die_on(!realpath(pdf_file, resolved_path), "Couldn't resolve %s\n",
            pdf_file);
 
-    char *uri = g_strdup_printf("file://%s", resolved_path);
-    GError *error = NULL;
-    state->document = poppler_document_new_from_file(uri, NULL, &error);
-    g_free(uri);
-    die_on(!state->document, "Error opening PDF: %s\n", error->message);
-
+    state->uri = g_strdup_printf("file://%s", resolved_path);
+    double start = now_ms();
+    if (watch) {
+        gchar *contents;
+        gsize len;
+        GError *error = NULL;
+        die_on(!g_file_get_contents(resolved_path, &contents, &len, &error),
+               "Error reading PDF: %s\n", error->message);
+        state->bytes = g_bytes_new_take(contents, len);
+    } else if (preload) {
+        state->bytes = map_document(resolved_path);
+    }
+    if (preload)
+        fprintf(stderr, "Preloaded %s (%.1f MiB) in %.1f ms\n", resolved_path,
+                g_bytes_get_size(state->bytes) / 1048576.0, now_ms() - start);
+    state->document = load_document(state->uri, state->bytes);
     state->num_pages = poppler_document_get_n_pages(state->document);
     die_on(state->num_pages <= 0, "PDF has no pages\n");
 }
 
-static void init_cache(struct bv_prog_state *state) {
-    state->needs_redraw = 1;
-    state->needs_cache = 1;
-    for (int i = 0; i < CACHE_SIZE; i++)
-        invalidate_cache_slot(&state->page_cache[i]);
-    page_cache_update(state, state->current_page);
+// Named for the hash of the PDF, so a rebuilt deck never gets stale pages
+static char *disk_cache_dir_for(GBytes *bytes) {
+    gsize len;
+    const guchar *data = g_bytes_get_data(bytes, &len);
+    gchar *hash = g_compute_checksum_for_data(G_CHECKSUM_SHA256, data, len);
+    char *dir =
+        g_build_filename(g_get_user_cache_dir(), "beamview", hash, NULL);
+    g_free(hash);
+    if (g_mkdir_with_parents(dir, 0700) != 0) {
+        fprintf(stderr, "Warning: Disk cache disabled: %s: %s\n", dir,
+                strerror(errno));
+        g_free(dir);
+        return NULL;
+    }
+    // Its mtime records when the deck was last opened, for prune_disk_cache
+    utimensat(AT_FDCWD, dir, NULL, 0);
+    return dir;
 }
 
-static void ensure_texture(struct bv_texture *texdata, SDL_Renderer *renderer,
-                           SDL_PixelFormatEnum pixel_fmt, int width,
-                           int height) {
-    if (texdata->texture == NULL || texdata->natural_width != width ||
-        texdata->natural_height != height) {
-        if (texdata->texture)
-            SDL_DestroyTexture(texdata->texture);
-        texdata->texture = SDL_CreateTexture(
-            renderer, pixel_fmt, SDL_TEXTUREACCESS_STREAMING, width, height);
-        expect(texdata->texture);
-        texdata->natural_width = width;
-        texdata->natural_height = height;
+static size_t disk_cache_dir_size(const char *dir) {
+    GDir *d = g_dir_open(dir, 0, NULL);
+    if (!d)
+        return 0;
+    size_t bytes = 0;
+    const char *name;
+    while ((name = g_dir_read_name(d))) {
+        struct stat st;
+        char *path = g_build_filename(dir, name, NULL);
+        if (stat(path, &st) == 0)
+            bytes += st.st_size;
+        g_free(path);
     }
+    g_dir_close(d);
+    return bytes;
 }
 
-static void update_texture_for_context(struct bv_sdl_ctx *ctx,
-                                       struct bv_cache_entry *entry) {
-    int base_split = entry->img_width / NUM_CTX;
-    int offset = ctx->region_index * base_split;
-    int region_width = (ctx->region_index == NUM_CTX - 1)
-                           ? (entry->img_width - offset)
-                           : base_split;
+struct bv_disk_deck {
+    char *dir;
+    time_t used;
+};
 
-    SDL_Renderer *renderer = ctx->renderer;
-    struct bv_texture *texdata = &ctx->texture;
-    SDL_PixelFormatEnum pixel_fmt = SDL_PIXELFORMAT_ARGB8888;
-    ensure_texture(texdata, renderer, pixel_fmt, region_width,
-                   entry->img_height);
+static int cmp_deck_used(const void *a, const void *b) {
+    const struct bv_disk_deck *x = a, *y = b;
+    return (x->used < y->used) - (x->used > y->used);
+}
 
-    int bytes_per_pixel = SDL_BYTESPERPIXEL(pixel_fmt);
-    int cairo_stride = cairo_image_surface_get_stride(entry->cairo_surface);
-    unsigned char *cairo_data =
-        cairo_image_surface_get_data(entry->cairo_surface);
-    expect(cairo_data);
-    unsigned char *region_data = cairo_data + offset * bytes_per_pixel;
-    expect(SDL_UpdateTexture(texdata->texture, NULL, region_data,
-                             cairo_stride) == 0);
-    present_texture(renderer, texdata->texture, region_width,
-                    entry->img_height);
+static void prune_disk_cache(const char *keep) {
+    char *root = g_build_filename(g_get_user_cache_dir(), "beamview", NULL);
+    GDir *d = g_dir_open(root, 0, NULL);
+    struct bv_disk_deck *decks = NULL;
+    int num_decks = 0;
+    const char *name;
+    while (d && (name = g_dir_read_name(d))) {
+        struct stat st;
+        char *dir = g_build_filename(root, name, NULL);
+        if (strcmp(dir, keep) == 0 || stat(dir, &st) != 0 ||
+            !S_ISDIR(st.st_mode)) {
+            g_free(dir);
+            continue;
+        }
+        decks = realloc(decks, (num_decks + 1) * sizeof(*decks));
+        expect(decks);
+        decks[num_decks++] = (struct bv_disk_deck){dir, st.st_mtime};
+    }
+    if (d)
+        g_dir_close(d);
+    g_free(root);
+
+    qsort(decks, num_decks, sizeof(*decks), cmp_deck_used);
+    size_t total = disk_cache_dir_size(keep);
+    size_t budget = (size_t)DISK_CACHE_MAX_MB * 1024 * 1024;
+    for (int i = 0; i < num_decks; i++) {
+        total += disk_cache_dir_size(decks[i].dir);
+        if (total > budget)
+            remove_disk_cache_dir(decks[i].dir);
+        g_free(decks[i].dir);
+    }
+    free(decks);
+}
+
+static void init_disk_cache(struct bv_prog_state *state, const char *pdf_file) {
+    GBytes *bytes = state->bytes ? g_bytes_ref(state->bytes) : NULL;
+    if (!bytes) {
+        gchar *contents;
+        gsize len;
+        GError *error = NULL;
+        if (!g_file_get_contents(pdf_file, &contents, &len, &error)) {
+            fprintf(stderr, "Warning: Disk cache disabled: %s\n",
+                    error->message);
+            g_error_free(error);
+            return;
+        }
+        bytes = g_bytes_new_take(contents, len);
+    }
+    state->disk_cache_dir = disk_cache_dir_for(bytes);
+    g_bytes_unref(bytes);
+    if (state->disk_cache_dir)
+        prune_disk_cache(state->disk_cache_dir);
+}
+
+static void checksum_surface(GChecksum *checksum, cairo_surface_t *surface) {
+    cairo_surface_flush(surface);
+    const guchar *data = cairo_image_surface_get_data(surface);
+    if (!data)
+        return;
+    int dims[] = {cairo_image_surface_get_width(surface),
+                  cairo_image_surface_get_height(surface)};
+    int stride = cairo_image_surface_get_stride(surface);
+    cairo_format_t format = cairo_image_surface_get_format(surface);
+    int row = format == CAIRO_FORMAT_ARGB32 || format == CAIRO_FORMAT_RGB24
+                  ? dims[0] * 4
+                  : stride;
+    g_checksum_update(checksum, (const guchar *)dims, sizeof(dims));
+    for (int y = 0; y < dims[1]; y++)
+        g_checksum_update(checksum, data + (size_t)y * stride, row);
+}
+
+// Images are hashed at their own resolution, to catch edits too subtle to
+// show in the reference render
+static void checksum_images(GChecksum *checksum, PopplerPage *page) {
+    GList *mappings = poppler_page_get_image_mapping(page);
+    for (GList *l = mappings; l; l = l->next) {
+        const PopplerImageMapping *mapping = l->data;
+        g_checksum_update(checksum, (const guchar *)&mapping->area,
+                          sizeof(mapping->area));
+        cairo_surface_t *image =
+            poppler_page_get_image(page, mapping->image_id);
+        if (image) {
+            checksum_surface(checksum, image);
+            cairo_surface_destroy(image);
+        }
+    }
+    poppler_page_free_image_mapping(mappings);
+}
+
+// poppler-glib doesn't expose content streams, so a page is identified by its
+// size, its text, its images, and a reference render
+static gchar *page_fingerprint(PopplerDocument *document, int page_index) {
+    PopplerPage *page = poppler_document_get_page(document, page_index);
+    expect(page);
+    double page_width, page_height;
+    poppler_page_get_size(page, &page_width, &page_height);
+
+    GChecksum *checksum = g_checksum_new(G_CHECKSUM_SHA256);
+    g_checksum_update(checksum, (const guchar *)&page_width,
+                      sizeof(page_width));
+    g_checksum_update(checksum, (const guchar *)&page_height,
+                      sizeof(page_height));
+    char *text = poppler_page_get_text(page);
+    if (text) {
+        g_checksum_update(checksum, (const guchar *)text, strlen(text));
+        g_free(text);
+    }
+    checksum_images(checksum, page);
+
+    double scale = FINGERPRINT_WIDTH / page_width;
+    int height = (int)ceil(page_height * scale);
+    cairo_surface_t *surface = cairo_image_surface_create(
+        CAIRO_FORMAT_ARGB32, FINGERPRINT_WIDTH, height > 0 ? height : 1);
+    cairo_t *cr = cairo_create(surface);
+    cairo_scale(cr, scale, scale);
+    poppler_page_render(page, cr);
+    cairo_destroy(cr);
+    checksum_surface(checksum, surface);
+    cairo_surface_destroy(surface);
+    g_object_unref(page);
+
+    gchar *fingerprint = g_strdup(g_checksum_get_string(checksum));
+    g_checksum_free(checksum);
+    return fingerprint;
+}
+
+static gchar **fingerprint_document(PopplerDocument *document,
+                                    int num_pages) {
+    gchar **fingerprints = g_new0(gchar *, num_pages + 1);
+    for (int i = 0; i < num_pages; i++)
+        fingerprints[i] = page_fingerprint(document, i);
+    return fingerprints;
+}
+
+// Pages are stored off by one, since a NULL lookup means no match
+static GHashTable *first_pages(gchar **fingerprints, int num_pages) {
+    GHashTable *first = g_hash_table_new(g_str_hash, g_str_equal);
+    for (int i = 0; i < num_pages; i++)
+        if (!g_hash_table_contains(first, fingerprints[i]))
+            g_hash_table_insert(first, fingerprints[i], GINT_TO_POINTER(i + 1));
+    return first;
+}
+
+static int first_page(GHashTable *first, const gchar *fingerprint) {
+    return GPOINTER_TO_INT(g_hash_table_lookup(first, fingerprint)) - 1;
+}
+
+static int *alias_pages(gchar **fingerprints, int num_pages) {
+    GHashTable *first = first_pages(fingerprints, num_pages);
+    int *alias = g_new(int, num_pages);
+    for (int i = 0; i < num_pages; i++)
+        alias[i] = first_page(first, fingerprints[i]);
+    g_hash_table_destroy(first);
+    return alias;
+}
+
+static int dedup_thread(void *data) {
+    struct bv_dedup *dedup = data;
+    PopplerDocument *document = load_document(dedup->uri, dedup->bytes);
+    int num_pages = poppler_document_get_n_pages(document);
+    gchar **fingerprints = fingerprint_document(document, num_pages);
+    g_object_unref(document);
+    if (num_pages == dedup->num_pages)
+        dedup->alias = alias_pages(fingerprints, num_pages);
+    g_strfreev(fingerprints);
+
+    SDL_Event event = {.user = {.type = dedup_event, .data1 = dedup}};
+    expect(SDL_PushEvent(&event) == 1);
+    return 0;
+}
+
+static void start_dedup(struct bv_prog_state *state) {
+    struct bv_dedup *dedup = g_new0(struct bv_dedup, 1);
+    dedup->uri = g_strdup(state->uri);
+    dedup->bytes = state->bytes ? g_bytes_ref(state->bytes) : NULL;
+    dedup->generation = state->doc_generation;
+    dedup->num_pages = state->num_pages;
+    SDL_Thread *thread = SDL_CreateThread(dedup_thread, "bv_dedup", dedup);
+    expect(thread);
+    SDL_DetachThread(thread);
+}
+
+#ifdef __linux__
+// Returns NULL if it can't be loaded, usually as it's still being written
+static struct bv_reload *watcher_load(struct bv_watcher *watcher) {
+    gchar *contents;
+    gsize len;
+    GError *error = NULL;
+    if (!g_file_get_contents(watcher->path, &contents, &len, &error)) {
+        fprintf(stderr, "Warning: Not reloading: %s\n", error->message);
+        g_error_free(error);
+        return NULL;
+    }
+    GBytes *bytes = g_bytes_new_take(contents, len);
+    PopplerDocument *document =
+        poppler_document_new_from_bytes(bytes, NULL, &error);
+    int num_pages = document ? poppler_document_get_n_pages(document) : 0;
+    if (num_pages <= 0) {
+        fprintf(stderr, "Warning: Not reloading %s: %s\n", watcher->path,
+                error ? error->message : "PDF has no pages");
+        if (error)
+            g_error_free(error);
+        if (document)
+            g_object_unref(document);
+        g_bytes_unref(bytes);
+        return NULL;
+    }
+
+    GHashTable *old = first_pages(watcher->fingerprints, watcher->num_pages);
+    struct bv_reload *reload = g_new0(struct bv_reload, 1);
+    reload->bytes = bytes;
+    reload->document = document;
+    reload->num_pages = num_pages;
+    reload->old_page = g_new(int, num_pages);
+    gchar **fingerprints = fingerprint_document(document, num_pages);
+    int unchanged = 0;
+    for (int i = 0; i < num_pages; i++) {
+        int old_page = first_page(old, fingerprints[i]);
+        reload->old_page[i] = old_page < 0 ? page_number_invalid : old_page;
+        unchanged += old_page >= 0;
+    }
+    g_hash_table_destroy(old);
+    reload->alias = alias_pages(fingerprints, num_pages);
+
+    g_strfreev(watcher->fingerprints);
+    watcher->fingerprints = fingerprints;
+    watcher->num_pages = num_pages;
+    fprintf(stderr, "Reloading %s: %d of %d pages changed\n", watcher->path,
+            num_pages - unchanged, num_pages);
+    return reload;
+}
+
+static int watcher_is_ours(const struct bv_watcher *watcher, const char *buf,
+                           ssize_t len) {
+    for (const char *p = buf; p < buf + len;) {
+        const struct inotify_event *event = (const struct inotify_event *)p;
+        if (event->len && strcmp(event->name, watcher->name) == 0)
+            return 1;
+        p += sizeof(*event) + event->len;
+    }
+    return 0;
+}
+
+static int watcher_thread(void *data) {
+    struct bv_watcher *watcher = data;
+
+    PopplerDocument *document = load_document(NULL, watcher->bytes);
+    watcher->num_pages = poppler_document_get_n_pages(document);
+    watcher->fingerprints =
+        fingerprint_document(document, watcher->num_pages);
+    g_object_unref(document);
+    g_bytes_unref(watcher->bytes);
+    watcher->bytes = NULL;
+
+    char buf[4096]
+        __attribute__((aligned(__alignof__(struct inotify_event))));
+    for (;;) {
+        ssize_t len = read(watcher->fd, buf, sizeof(buf));
+        if (len < 0 && errno == EINTR)
+            continue;
+        if (len <= 0) {
+            fprintf(stderr, "Warning: Stopped watching %s: %s\n",
+                    watcher->path, strerror(errno));
+            return 0;
+        }
+        if (!watcher_is_ours(watcher, buf, len))
+            continue;
+
+        // Wait for the build to stop writing
+        struct pollfd pfd = {.fd = watcher->fd, .events = POLLIN};
+        while (poll(&pfd, 1, RELOAD_SETTLE_MS) > 0 &&
+               read(watcher->fd, buf, sizeof(buf)) > 0)
+            ;
+
+        struct bv_reload *reload = watcher_load(watcher);
+        if (reload) {
+            SDL_Event event = {.user = {.type = reload_event,
+                                        .data1 = reload}};
+            expect(SDL_PushEvent(&event) == 1);
+        }
+    }
+}
+
+// Watches the directory, since a build may replace the file
+static void start_watcher(struct bv_prog_state *state) {
+    struct bv_watcher *watcher = g_new0(struct bv_watcher, 1);
+    watcher->path = g_filename_from_uri(state->uri, NULL, NULL);
+    expect(watcher->path);
+    watcher->name = g_path_get_basename(watcher->path);
+    char *dir = g_path_get_dirname(watcher->path);
+    watcher->fd = inotify_init1(IN_CLOEXEC);
+    if (watcher->fd < 0 ||
+        inotify_add_watch(watcher->fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+        fprintf(stderr, "Warning: Not watching %s: %s\n", watcher->path,
+                strerror(errno));
+        if (watcher->fd >= 0)
+            close(watcher->fd);
+        g_free(dir);
+        g_free(watcher->name);
+        g_free(watcher->path);
+        g_free(watcher);
+        return;
+    }
+    g_free(dir);
+
+    watcher->bytes = g_bytes_ref(state->bytes);
+    SDL_Thread *thread =
+        SDL_CreateThread(watcher_thread, "bv_watcher", watcher);
+    expect(thread);
+    SDL_DetachThread(thread);
+}
+#else
+// Refused by parse_args()
+static void start_watcher(struct bv_prog_state *state) {
+    (void)state;
 }
+#endif
 
 static void update_scale(struct bv_prog_state *state) {
-    page_cache_update(state, state->current_page);
-    struct bv_cache_entry *entry =
-        cache_slot(state->page_cache, state->current_page);
-    state->current_scale = compute_scale(state->ctx, NUM_CTX, entry->page_width,
-                                         entry->page_height);
-    init_cache(state);
+    double page_width, page_height;
+    get_page_size(state->document, state->current_page, &page_width,
+                  &page_height);
+    double max_scale = 0;
+    for (int i = 0; i < NUM_CTX; i++) {
+        double scale = compute_scale(&state->ctx[i], page_width, page_height);
+        state->region_scale[state->ctx[i].region_index] = scale;
+        max_scale = SDL_max(max_scale, scale);
+    }
+    render_pool_set_record_scale(state->pool, max_scale);
+    state->needs_redraw = 1;
+    state->needs_cache = 1;
+    state->rescale_pending = 0;
+}
+
+// Resizes come in bursts, so re-rendering waits for them to settle
+static void schedule_rescale(struct bv_prog_state *state) {
+    state->rescale_pending = 1;
+    state->rescale_deadline = SDL_GetTicks() + RESCALE_DEBOUNCE_MS;
+    state->needs_redraw = 1;
 }
 
 static void handle_fullscreen_event(const SDL_Event *event,
@@ -285,45 +3387,417 @@ static void handle_fullscreen_event(const SDL_Event *event,
     update_scale(state);
 }
 
-static void handle_navigation_event(const SDL_Keycode key,
+// The page we'll be on once pending navigation is done
+static int nav_from(const struct bv_prog_state *state) {
+    return state->nav_pending ? state->nav_target : state->current_page;
+}
+
+static void queue_navigation(struct bv_prog_state *state, int new_page,
+                             int jump, Uint32 timestamp) {
+    int from = nav_from(state);
+    if (new_page != from) {
+        struct bv_prefetch *pf = &state->prefetch;
+        int direction = new_page > from ? 1 : -1;
+        if (jump) {
+            // Talks carry on forwards from wherever we land
+            pf->fast = 0;
+            pf->direction = 1;
+        } else {
+            pf->fast = direction == pf->direction &&
+                       timestamp - pf->last_turn < FAST_TURN_MS;
+            pf->direction = direction;
+        }
+        pf->last_turn = timestamp;
+        state->nav_jump |= jump;
+
+        // Latency is counted from the first of a run of coalesced presses
+        if (!state->nav_pending)
+            state->nav_timestamp = timestamp;
+        state->nav_pending = 1;
+        state->nav_target = new_page;
+    }
+}
+
+static int keycode_digit(SDL_Keycode key) {
+    if (key >= SDLK_0 && key <= SDLK_9)
+        return key - SDLK_0;
+    if (key >= SDLK_KP_1 && key <= SDLK_KP_9)
+        return key - SDLK_KP_1 + 1;
+    if (key == SDLK_KP_0)
+        return 0;
+    return -1;
+}
+
+static int handle_jump_key(SDL_Keycode key, struct bv_prog_state *state,
+                           int from) {
+    int digit = keycode_digit(key);
+    if (digit >= 0) {
+        if (state->typed_page <= state->num_pages)
+            state->typed_page = state->typed_page * 10 + digit;
+        return from;
+    }
+
+    int typed = state->typed_page;
+    state->typed_page = 0;
+    switch (key) {
+        case SDLK_RETURN:
+        case SDLK_KP_ENTER:
+            if (!typed)
+                return from;
+            return (typed < state->num_pages ? typed : state->num_pages) - 1;
+        case SDLK_BACKSPACE:
+            if (typed) {
+                state->typed_page = typed / 10;
+                return from;
+            }
+            return state->back_page == page_number_invalid ? from
+                                                           : state->back_page;
+        case SDLK_HOME:
+            return 0;
+        case SDLK_END:
+            return state->num_pages - 1;
+        default:
+            return from;
+    }
+}
+
+static void handle_navigation_event(const SDL_Event *event,
                                     struct bv_prog_state *state) {
-    int new_page = state->current_page;
+    const SDL_Keycode key = event->key.keysym.sym;
+    int from = nav_from(state), new_page = from, jump = 0;
     if ((key == SDLK_LEFT || key == SDLK_UP || key == SDLK_PAGEUP) &&
-        state->current_page > 0) {
-        new_page = state->current_page - 1;
+        from > 0) {
+        new_page = from - 1;
     } else if ((key == SDLK_RIGHT || key == SDLK_DOWN ||
                 key == SDLK_PAGEDOWN) &&
-               state->current_page < state->num_pages - 1) {
-        new_page = state->current_page + 1;
+               from < state->num_pages - 1) {
+        new_page = from + 1;
+    } else {
+        new_page = handle_jump_key(key, state, from);
+        jump = 1;
+    }
+    if (!jump)
+        state->typed_page = 0;
+
+    queue_navigation(state, new_page, jump, event->key.timestamp);
+}
+
+// Called once events are drained, so only the final page is rendered
+static void finish_navigation(struct bv_prog_state *state) {
+    if (!state->nav_pending)
+        return;
+    state->nav_pending = 0;
+    int new_page = state->nav_target, jump = state->nav_jump;
+    state->nav_jump = 0;
+    if (new_page == state->current_page)
+        return;
+    if (jump)
+        state->back_page = state->current_page;
+
+    load_stored_page(state, new_page);
+    int is_hit = page_is_cached(state, new_page);
+    if (!is_hit)
+        fprintf(stderr, "Warning: Page %d rendered live\n", new_page);
+    latency_start(&state->latency, state->nav_timestamp, is_hit);
+    state->current_page = new_page;
+    state->needs_redraw = 1;
+    state->needs_cache = 1;
+}
+
+static int remap_page(const int *new_page, int page_index) {
+    return page_index == page_number_invalid ? page_number_invalid
+                                             : new_page[page_index];
+}
+
+// Move whatever we have of duplicate pages to where page_key() will look
+static void rekey_pages(struct bv_prog_state *state) {
+    struct bv_page_cache *caches[] = {&state->page_cache, &state->cold_cache};
+    for (int i = 0; i < 2; i++)
+        for (struct bv_cache_entry *e = caches[i]->head; e; e = e->next)
+            e->page_number = page_key(state, e->page_number);
+    for (int i = 0; i < NUM_CTX; i++)
+        for (int t = 0; t < NUM_TEXTURES; t++)
+            state->ctx[i].textures[t].page_number =
+                page_key(state, state->ctx[i].textures[t].page_number);
+    state->needs_cache = 1;
+    state->needs_redraw = 1;
+}
+
+static void apply_dedup(struct bv_prog_state *state, struct bv_dedup *dedup) {
+    if (dedup->alias && dedup->generation == state->doc_generation) {
+        int unique = 0;
+        for (int i = 0; i < state->num_pages; i++)
+            unique += dedup->alias[i] == i;
+        fprintf(stderr, "%d of %d pages are unique\n", unique,
+                state->num_pages);
+        g_free(state->page_alias);
+        state->page_alias = dedup->alias;
+        rekey_pages(state);
+    } else {
+        g_free(dedup->alias);
+    }
+    if (dedup->bytes)
+        g_bytes_unref(dedup->bytes);
+    g_free(dedup->uri);
+    g_free(dedup);
+}
+
+// Renders of unchanged pages are kept and renumbered, the rest dropped
+static void apply_reload(struct bv_prog_state *state,
+                         struct bv_reload *reload) {
+    int workers = state->pool->num_workers, tiles = state->pool->tiles;
+    int isolate = state->pool->isolate;
+    size_t record_budget = state->pool->record_budget;
+    int remove_old_dir = 0;
+    if (state->disk_cache_dir) {
+        char *old_dir = state->disk_cache_dir;
+        state->disk_cache_dir = disk_cache_dir_for(reload->bytes);
+        for (int i = 0; state->disk_cache_dir && i < reload->num_pages; i++) {
+            if (reload->old_page[i] == page_number_invalid)
+                continue;
+            double page_width, page_height;
+            get_page_size(reload->document, i, &page_width, &page_height);
+            for (int r = 0; r < NUM_CTX; r++) {
+                int width, height;
+                region_surface_size(page_width, page_height,
+                                    state->region_scale[r], &width, &height);
+                disk_cache_migrate(old_dir, reload->old_page[i],
+                                   state->disk_cache_dir, i, r, width,
+                                   height);
+            }
+        }
+        remove_old_dir =
+            state->disk_cache_dir && strcmp(old_dir, state->disk_cache_dir);
+        g_free(old_dir);
+    }
+    render_pool_retire(state->pool, remove_old_dir);
+
+    int *new_page = g_new(int, state->num_pages);
+    for (int i = 0; i < state->num_pages; i++)
+        new_page[i] = page_number_invalid;
+    for (int i = 0; i < reload->num_pages; i++)
+        if (reload->old_page[i] != page_number_invalid)
+            new_page[reload->old_page[i]] = i;
+
+    struct bv_page_cache *caches[] = {&state->page_cache, &state->cold_cache};
+    for (int i = 0; i < 2; i++) {
+        struct bv_cache_entry *e = caches[i]->head;
+        while (e) {
+            struct bv_cache_entry *next = e->next;
+            e->page_number = remap_page(new_page, e->page_number);
+            if (e->page_number == page_number_invalid)
+                cache_remove(caches[i], e);
+            e = next;
+        }
+    }
+    for (int i = 0; i < NUM_CTX; i++)
+        for (int t = 0; t < NUM_TEXTURES; t++)
+            state->ctx[i].textures[t].page_number = remap_page(
+                new_page, state->ctx[i].textures[t].page_number);
+    struct bv_render_cost *render_cost =
+        g_new0(struct bv_render_cost, reload->num_pages);
+    for (int i = 0; i < reload->num_pages; i++)
+        if (reload->old_page[i] != page_number_invalid)
+            render_cost[i] = state->render_cost[reload->old_page[i]];
+    g_free(state->render_cost);
+    state->render_cost = render_cost;
+    struct bv_overview *ov = &state->overview;
+    cairo_surface_t **thumbs = g_new0(cairo_surface_t *, reload->num_pages);
+    for (int i = 0; i < reload->num_pages; i++)
+        if (reload->old_page[i] != page_number_invalid)
+            thumbs[i] =
+                cairo_surface_reference(ov->thumbs[reload->old_page[i]]);
+    for (int i = 0; i < state->num_pages; i++)
+        cairo_surface_destroy(ov->thumbs[i]);
+    g_free(ov->thumbs);
+    ov->thumbs = thumbs;
+
+    int current_page = remap_page(new_page, state->current_page);
+    if (current_page == page_number_invalid)
+        current_page = SDL_min(state->current_page, reload->num_pages - 1);
+    state->current_page = current_page;
+    state->back_page = remap_page(new_page, state->back_page);
+    state->nav_pending = 0;
+    g_free(new_page);
+
+    g_object_unref(state->document);
+    g_bytes_unref(state->bytes);
+    state->document = reload->document;
+    state->bytes = reload->bytes;
+    state->num_pages = reload->num_pages;
+    state->doc_generation++;
+    g_free(state->page_alias);
+    state->page_alias = NULL;
+    if (state->dedup) {
+        state->page_alias = reload->alias;
+        rekey_pages(state);
+    } else {
+        g_free(reload->alias);
     }
+    g_free(reload->old_page);
+    g_free(reload);
+
+    state->pool = render_pool_new(state->uri, state->bytes, workers, tiles,
+                                  isolate, record_budget,
+                                  state->disk_cache_dir);
+    state->page_cache.packer = state->pool;
+    SDL_DestroyTexture(ov->atlas);
+    init_overview(state);
+    ov->selected = SDL_min(ov->selected, state->num_pages - 1);
+    update_scale(state);
+}
+
+static void toggle_overview(struct bv_prog_state *state) {
+    struct bv_overview *ov = &state->overview;
+    ov->active = !ov->active;
+    ov->selected = nav_from(state);
+    state->needs_redraw = 1;
+}
 
-    if (new_page != state->current_page) {
-        if (page_cache_update(state, new_page) == CACHE_UPDATED)
-            fprintf(stderr, "Warning: Page %d rendered live\n", new_page);
-        state->current_page = new_page;
+static void overview_pick(struct bv_prog_state *state, int page_index,
+                          Uint32 timestamp) {
+    state->overview.active = 0;
+    state->needs_redraw = 1;
+    queue_navigation(state, page_index, 1, timestamp);
+}
+
+// Returns 0 for keys left to the usual handling
+static int handle_overview_key(const SDL_Event *event,
+                               struct bv_prog_state *state) {
+    struct bv_overview *ov = &state->overview;
+    int selected = ov->selected;
+    switch (event->key.keysym.sym) {
+        case SDLK_LEFT:
+            selected--;
+            break;
+        case SDLK_RIGHT:
+            selected++;
+            break;
+        case SDLK_UP:
+            selected -= ov->cols;
+            break;
+        case SDLK_DOWN:
+            selected += ov->cols;
+            break;
+        case SDLK_RETURN:
+        case SDLK_KP_ENTER:
+            if (state->typed_page)
+                return 0;
+            overview_pick(state, ov->selected, event->key.timestamp);
+            return 1;
+        case SDLK_ESCAPE:
+            ov->active = 0;
+            state->needs_redraw = 1;
+            return 1;
+        default:
+            return 0;
+    }
+    if (selected >= 0 && selected < state->num_pages) {
+        ov->selected = selected;
         state->needs_redraw = 1;
-        state->needs_cache = 1;
     }
+    return 1;
+}
+
+static void handle_overview_click(const SDL_Event *event,
+                                  struct bv_prog_state *state) {
+    struct bv_sdl_ctx *ctx = region_ctx(state, PRESENTER_REGION);
+    const struct bv_overview *ov = &state->overview;
+    if (!ov->active || event->button.button != SDL_BUTTON_LEFT ||
+        event->button.windowID != SDL_GetWindowID(ctx->window))
+        return;
+
+    // Clicks are in window coordinates, which may not be pixels
+    int win_width, win_height, out_width, out_height;
+    SDL_GetWindowSize(ctx->window, &win_width, &win_height);
+    SDL_GetRendererOutputSize(ctx->renderer, &out_width, &out_height);
+    int x = event->button.x * out_width / win_width;
+    int y = event->button.y * out_height / win_height;
+
+    SDL_Rect dst = overview_rect(ctx, ov);
+    if (x < dst.x || y < dst.y || x >= dst.x + dst.w || y >= dst.y + dst.h)
+        return;
+    int page_index = (y - dst.y) * ov->rows / dst.h * ov->cols +
+                     (x - dst.x) * ov->cols / dst.w;
+    if (page_index < state->num_pages)
+        overview_pick(state, page_index, event->button.timestamp);
 }
 
-static void init_prog_state(struct bv_prog_state *state, const char *pdf_file) {
+static void init_prog_state(struct bv_prog_state *state,
+                            const struct bv_config *cfg) {
     *state = (struct bv_prog_state){0};
-    open_document(state, pdf_file);
-    init_cache(state);
-    create_contexts(state->ctx, NUM_CTX);
+    state->page_cache.budget = cfg->cache_bytes;
+    state->cold_cache.budget = cfg->compress_bytes;
+    if (cfg->compress_bytes)
+        state->page_cache.spill = &state->cold_cache;
+    state->progressive = cfg->progressive;
+    state->drop_uploaded = cfg->drop_uploaded;
+    state->back_page = page_number_invalid;
+    state->prefetch = (struct bv_prefetch){.ahead = cfg->prefetch_ahead,
+                                           .behind = cfg->prefetch_behind,
+                                           .direction = 1};
+    open_document(state, cfg->pdf_file, cfg->watch, cfg->preload);
+    state->render_budget_ms = cfg->render_budget_ms;
+    state->render_cost = g_new0(struct bv_render_cost, state->num_pages);
+    if (cfg->disk_cache)
+        init_disk_cache(state, cfg->pdf_file);
+    state->pool = render_pool_new(state->uri, state->bytes, cfg->workers,
+                                  cfg->tiles, cfg->isolate, cfg->record_bytes,
+                                  state->disk_cache_dir);
+    state->page_cache.packer = state->pool;
+    create_contexts(state->ctx, NUM_CTX, 0);
     update_scale(state);
+    state->overview.thumbs = g_new0(cairo_surface_t *, state->num_pages);
+    init_overview(state);
+    if (cfg->watch)
+        start_watcher(state);
+    state->dedup = cfg->dedup;
+    if (cfg->dedup)
+        start_dedup(state);
+}
+
+// Returns 0 if the page isn't available at all
+static int select_texture(struct bv_prog_state *state, struct bv_sdl_ctx *ctx,
+                          double scale) {
+    int page_index = page_key(state, state->current_page);
+    int idx = find_texture(ctx, page_index, scale);
+    if (idx < 0) {
+        struct bv_cache_entry *entry = cache_lookup(
+            &state->page_cache, page_index, ctx->region_index, scale);
+        if (!entry)
+            return 0;
+        idx = spare_texture(ctx, page_index, scale);
+        upload_entry(state, ctx, idx, entry);
+        // The spare may have held a neighbour we were counting on
+        state->needs_cache = 1;
+    }
+    ctx->front = idx;
+    return 1;
 }
 
 static void update_window_textures(struct bv_prog_state *state) {
-    struct bv_cache_entry *entry =
-        cache_slot(state->page_cache, state->current_page);
-    expect(entry->cairo_surface);
+    state->needs_redraw = 0;
 
     for (int i = 0; i < NUM_CTX; i++) {
-        update_texture_for_context(&state->ctx[i], entry);
+        struct bv_sdl_ctx *ctx = &state->ctx[i];
+        if (state->overview.active && ctx->region_index == PRESENTER_REGION) {
+            draw_overview(state, ctx);
+            continue;
+        }
+        double scale = state->region_scale[ctx->region_index];
+        // Failing that, anything we have of the page, even at a stale scale,
+        // beats a blank window until handle_render_done() wakes us
+        if (!select_texture(state, ctx, scale) &&
+            !(state->progressive &&
+              select_texture(state, ctx, job_scale(scale, 1))) &&
+            !select_texture(state, ctx, scale_any))
+            continue;
+        struct bv_texture *texdata = &ctx->textures[ctx->front];
+        present_texture(ctx->renderer, texdata->texture,
+                        texdata->natural_width, texdata->natural_height);
+        if (texdata->scale == scale && !texdata->derived)
+            latency_presented(&state->latency, i);
     }
-
-    state->needs_redraw = 0;
 }
 
 static void key_handler(const SDL_Event *event, struct bv_prog_state *state,
@@ -335,16 +3809,27 @@ static void key_handler(const SDL_Event *event, struct bv_prog_state *state,
         *running = 0;
     } else if (key == SDLK_f && (mod & KMOD_SHIFT)) {
         handle_fullscreen_event(event, state);
+    } else if (key == SDLK_TAB) {
+        toggle_overview(state);
+    } else if (state->overview.active && handle_overview_key(event, state)) {
+        // Handled as grid movement
     } else {
-        handle_navigation_event(key, state);
+        handle_navigation_event(event, state);
     }
 }
 
 static void handle_sdl_events(struct bv_prog_state *state) {
-    int running = 1;
+    int running = 1, rendering = 0;
     while (running) {
-        if (!state->needs_redraw && !state->needs_cache) {
-            SDL_WaitEvent(NULL);
+        if (!state->needs_redraw && !state->needs_cache && !rendering) {
+            if (state->rescale_pending) {
+                Sint32 wait =
+                    (Sint32)(state->rescale_deadline - SDL_GetTicks());
+                if (wait > 0)
+                    SDL_WaitEventTimeout(NULL, wait);
+            } else {
+                SDL_WaitEvent(NULL);
+            }
         }
 
         SDL_Event event;
@@ -358,56 +3843,429 @@ static void handle_sdl_events(struct bv_prog_state *state) {
                     key_handler(&event, state, &running);
                     break;
 
+                case SDL_MOUSEBUTTONDOWN:
+                    handle_overview_click(&event, state);
+                    break;
+
                 case SDL_WINDOWEVENT:
                     if (event.window.event == SDL_WINDOWEVENT_SIZE_CHANGED) {
-                        update_scale(state);
+                        schedule_rescale(state);
                     } else if (event.window.event == SDL_WINDOWEVENT_EXPOSED ||
                                event.window.event == SDL_WINDOWEVENT_SHOWN ||
                                event.window.event == SDL_WINDOWEVENT_RESTORED) {
                         state->needs_redraw = 1;
                     }
                     break;
+
+                default:
+                    if (event.type == render_done_event) {
+                        handle_render_done(event.user.data1, state);
+                    } else if (event.type == latency_report_event) {
+                        latency_report(&state->latency);
+                        recording_report(state->pool);
+                        render_cost_report(state);
+                    } else if (event.type == reload_event) {
+                        apply_reload(state, event.user.data1);
+                    } else if (event.type == dedup_event) {
+                        apply_dedup(state, event.user.data1);
+                    }
+                    break;
             }
         }
 
+        finish_navigation(state);
+
+        if (state->rescale_pending &&
+            SDL_TICKS_PASSED(SDL_GetTicks(), state->rescale_deadline)) {
+            update_scale(state);
+        }
+
+        if (state->needs_cache) {
+            idle_update_cache(state);
+        }
+
         if (state->needs_redraw) {
             update_window_textures(state);
         }
 
-        idle_update_cache(state);
+        // Without worker threads, render a band and then check for input
+        // again, so a key press is only ever held up by one band
+        rendering = !state->pool->num_workers && render_pool_step(state->pool);
+    }
+}
+
+static void destroy_contexts(struct bv_sdl_ctx ctx[], int num_ctx) {
+    for (int i = 0; i < num_ctx; i++) {
+        for (int t = 0; t < NUM_TEXTURES; t++)
+            if (ctx[i].textures[t].texture)
+                SDL_DestroyTexture(ctx[i].textures[t].texture);
+        SDL_DestroyRenderer(ctx[i].renderer);
+        SDL_DestroyWindow(ctx[i].window);
     }
 }
 
 static void free_prog_state(struct bv_prog_state *state) {
-    for (int i = 0; i < CACHE_SIZE; i++) {
-        invalidate_cache_slot(&state->page_cache[i]);
+    latency_report(&state->latency);
+    recording_report(state->pool);
+    render_cost_report(state);
+    render_pool_destroy(state->pool);
+    cache_clear(&state->page_cache);
+    cache_clear(&state->cold_cache);
+    SDL_DestroyTexture(state->overview.atlas);
+    for (int i = 0; i < state->num_pages; i++)
+        cairo_surface_destroy(state->overview.thumbs[i]);
+    g_free(state->overview.thumbs);
+    destroy_contexts(state->ctx, NUM_CTX);
+    g_object_unref(state->document);
+    if (state->bytes)
+        g_bytes_unref(state->bytes);
+    g_free(state->uri);
+    g_free(state->disk_cache_dir);
+    g_free(state->page_alias);
+    g_free(state->render_cost);
+}
+
+enum bv_bench_stage { STAGE_RENDER, STAGE_UPLOAD, STAGE_PRESENT, NUM_STAGES };
+static const char *const bench_stage_names[NUM_STAGES] = {"render", "upload",
+                                                          "present"};
+static const struct {
+    int width, height;
+} bench_resolutions[] = {{1280, 720}, {1920, 1080}, {3840, 2160}};
+#define NUM_BENCH_RES (sizeof(bench_resolutions) / sizeof(*bench_resolutions))
+
+struct bv_bench_stats {
+    double p50, p95, p99, max;
+    int samples;
+};
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static double percentile(const double *sorted, int n, double pct) {
+    int rank = (int)ceil(pct / 100.0 * n);
+    return sorted[rank > 0 ? rank - 1 : 0];
+}
+
+static struct bv_bench_stats bench_summarise(double *samples, int n) {
+    qsort(samples, n, sizeof(*samples), cmp_double);
+    return (struct bv_bench_stats){.p50 = percentile(samples, n, 50),
+                                   .p95 = percentile(samples, n, 95),
+                                   .p99 = percentile(samples, n, 99),
+                                   .max = samples[n - 1],
+                                   .samples = n};
+}
+
+static void json_print_string(FILE *f, const char *str) {
+    fputc('"', f);
+    for (const unsigned char *c = (const unsigned char *)str; *c; c++) {
+        if (*c == '"' || *c == '\\')
+            fprintf(f, "\\%c", *c);
+        else if (*c < 0x20)
+            fprintf(f, "\\u%04x", *c);
+        else
+            fputc(*c, f);
     }
-    for (int i = 0; i < NUM_CTX; i++) {
-        SDL_DestroyTexture(state->ctx[i].texture.texture);
-        SDL_DestroyRenderer(state->ctx[i].renderer);
-        SDL_DestroyWindow(state->ctx[i].window);
+    fputc('"', f);
+}
+
+// Prints a table to stderr and JSON to stdout
+static void run_bench(const struct bv_config *cfg) {
+    struct bv_prog_state state = {0};
+    open_document(&state, cfg->pdf_file, 0, cfg->preload);
+    state.pool = render_pool_new(state.uri, state.bytes, cfg->workers,
+                                 cfg->tiles, cfg->isolate, cfg->record_bytes,
+                                 NULL);
+    create_contexts(state.ctx, NUM_CTX, 1);
+
+    struct bv_bench_stats stats[NUM_BENCH_RES][NUM_STAGES];
+    int max_samples = state.num_pages * NUM_CTX;
+    double *samples[NUM_STAGES];
+    for (int s = 0; s < NUM_STAGES; s++) {
+        samples[s] = malloc(max_samples * sizeof(*samples[s]));
+        expect(samples[s]);
     }
-    g_object_unref(state->document);
+
+    for (size_t r = 0; r < NUM_BENCH_RES; r++) {
+        for (int i = 0; i < NUM_CTX; i++)
+            SDL_SetWindowSize(state.ctx[i].window, bench_resolutions[r].width,
+                              bench_resolutions[r].height);
+        SDL_PumpEvents();
+
+        int n_samples[NUM_STAGES] = {0};
+        for (int p = 0; p < state.num_pages; p++) {
+            double page_width, page_height;
+            get_page_size(state.document, p, &page_width, &page_height);
+
+            for (int i = 0; i < NUM_CTX; i++) {
+                struct bv_sdl_ctx *ctx = &state.ctx[i];
+                double scale = compute_scale(ctx, page_width, page_height);
+
+                double start = now_ms();
+                struct bv_cache_entry entry =
+                    render_pool_render_sync(state.pool, p, ctx->region_index,
+                                            scale, page_width, page_height);
+                double rendered = now_ms();
+                update_texture_for_context(ctx, ctx->front, &entry, NULL);
+                double uploaded = now_ms();
+                struct bv_texture *texdata = &ctx->textures[ctx->front];
+                present_texture(ctx->renderer, texdata->texture,
+                                texdata->natural_width,
+                                texdata->natural_height);
+                samples[STAGE_RENDER][n_samples[STAGE_RENDER]++] =
+                    rendered - start;
+                samples[STAGE_UPLOAD][n_samples[STAGE_UPLOAD]++] =
+                    uploaded - rendered;
+                samples[STAGE_PRESENT][n_samples[STAGE_PRESENT]++] =
+                    now_ms() - uploaded;
+                cairo_surface_destroy(entry.cairo_surface);
+            }
+        }
+
+        for (int s = 0; s < NUM_STAGES; s++)
+            stats[r][s] = bench_summarise(samples[s], n_samples[s]);
+    }
+
+    struct rusage usage;
+    expect(getrusage(RUSAGE_SELF, &usage) == 0);
+
+    fprintf(stderr, "%-10s %-8s %9s %9s %9s %9s\n", "resolution", "stage",
+            "p50 ms", "p95 ms", "p99 ms", "max ms");
+    for (size_t r = 0; r < NUM_BENCH_RES; r++) {
+        for (int s = 0; s < NUM_STAGES; s++) {
+            char res[32];
+            snprintf(res, sizeof(res), "%dx%d", bench_resolutions[r].width,
+                     bench_resolutions[r].height);
+            fprintf(stderr, "%-10s %-8s %9.2f %9.2f %9.2f %9.2f\n", res,
+                    bench_stage_names[s], stats[r][s].p50, stats[r][s].p95,
+                    stats[r][s].p99, stats[r][s].max);
+        }
+    }
+    fprintf(stderr, "peak rss: %ld KiB\n", usage.ru_maxrss);
+
+    printf("{\"pdf\": ");
+    json_print_string(stdout, cfg->pdf_file);
+    printf(", \"pages\": %d, \"peak_rss_kib\": %ld, \"resolutions\": [",
+           state.num_pages, usage.ru_maxrss);
+    for (size_t r = 0; r < NUM_BENCH_RES; r++) {
+        printf("%s{\"width\": %d, \"height\": %d", r ? ", " : "",
+               bench_resolutions[r].width, bench_resolutions[r].height);
+        for (int s = 0; s < NUM_STAGES; s++)
+            printf(", \"%s\": {\"p50_ms\": %.3f, \"p95_ms\": %.3f, "
+                   "\"p99_ms\": %.3f, \"max_ms\": %.3f, \"samples\": %d}",
+                   bench_stage_names[s], stats[r][s].p50, stats[r][s].p95,
+                   stats[r][s].p99, stats[r][s].max, stats[r][s].samples);
+        printf("}");
+    }
+    printf("]}\n");
+
+    for (int s = 0; s < NUM_STAGES; s++)
+        free(samples[s]);
+    render_pool_destroy(state.pool);
+    destroy_contexts(state.ctx, NUM_CTX);
+    g_object_unref(state.document);
+    if (state.bytes)
+        g_bytes_unref(state.bytes);
+    g_free(state.uri);
 }
 
-int main(int argc, char *argv[]) {
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s <pdf_file>\nSee `man 1 beamview`.\n",
-                argv[0]);
-        return EXIT_FAILURE;
+static long parse_long_arg(const char *name, const char *arg, long min) {
+    char *end;
+    errno = 0;
+    long val = strtol(arg, &end, 10);
+    die_on(errno || end == arg || *end || val < min,
+           "Invalid value for --%s: %s\n", name, arg);
+    return val;
+}
+
+static void usage(const char *argv0) {
+    fprintf(stderr, "Usage: %s [options] <pdf_file>\nSee `man 1 beamview`.\n",
+            argv0);
+    exit(EXIT_FAILURE);
+}
+
+static void parse_args(int argc, char *argv[], struct bv_config *cfg) {
+    static const struct option long_opts[] = {
+        {"bench", no_argument, NULL, 'b'},
+        {"cache-mb", required_argument, NULL, 'c'},
+        {"compress-mb", required_argument, NULL, 'z'},
+        {"dedup", no_argument, NULL, 'e'},
+        {"disk-cache", no_argument, NULL, 'd'},
+        {"drop-uploaded", no_argument, NULL, 'u'},
+        {"help", no_argument, NULL, 'h'},
+        {"isolate", no_argument, NULL, 'i'},
+        {"prefetch-ahead", required_argument, NULL, 'a'},
+        {"record-mb", required_argument, NULL, 'm'},
+        {"render-budget-ms", required_argument, NULL, 'g'},
+        {"prefetch-behind", required_argument, NULL, 'r'},
+        {"preload", no_argument, NULL, 'l'},
+        {"progressive", no_argument, NULL, 'p'},
+        {"tiles", required_argument, NULL, 't'},
+        {"watch", no_argument, NULL, 'w'},
+        {"workers", required_argument, NULL, 'n'},
+        {0},
+    };
+
+    *cfg = (struct bv_config){.cache_bytes = (size_t)DEFAULT_CACHE_MB << 20,
+                              .prefetch_ahead = DEFAULT_PREFETCH_AHEAD,
+                              .prefetch_behind = DEFAULT_PREFETCH_BEHIND,
+                              .workers = -1};
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "h", long_opts, NULL)) != -1) {
+        switch (opt) {
+            case 'a':
+                cfg->prefetch_ahead =
+                    (int)parse_long_arg("prefetch-ahead", optarg, 0);
+                break;
+            case 'b':
+                cfg->bench = 1;
+                break;
+            case 'c':
+                cfg->cache_bytes =
+                    (size_t)parse_long_arg("cache-mb", optarg, 0) << 20;
+                break;
+            case 'd':
+                cfg->disk_cache = 1;
+                break;
+            case 'e':
+                cfg->dedup = 1;
+                break;
+            case 'g':
+                cfg->render_budget_ms =
+                    (int)parse_long_arg("render-budget-ms", optarg, 1);
+                break;
+            case 'i':
+                cfg->isolate = 1;
+                break;
+            case 'l':
+                cfg->preload = 1;
+                break;
+            case 'm':
+                cfg->record_bytes =
+                    (size_t)parse_long_arg("record-mb", optarg, 0) << 20;
+                break;
+            case 'n':
+                cfg->workers = (int)parse_long_arg("workers", optarg, 0);
+                break;
+            case 'p':
+                cfg->progressive = 1;
+                break;
+            case 'r':
+                cfg->prefetch_behind =
+                    (int)parse_long_arg("prefetch-behind", optarg, 0);
+                break;
+            case 'u':
+                cfg->drop_uploaded = 1;
+                break;
+            case 't':
+                cfg->tiles = (int)parse_long_arg("tiles", optarg, 1);
+                break;
+            case 'w':
+                cfg->watch = 1;
+                break;
+            case 'z':
+                cfg->compress_bytes =
+                    (size_t)parse_long_arg("compress-mb", optarg, 0) << 20;
+                break;
+            case 'h':
+                execlp("man", "man", "1", "beamview", NULL);
+                perror("execlp man");
+                exit(EXIT_FAILURE);
+            default:
+                usage(argv[0]);
+        }
+    }
+
+#ifndef __linux__
+    // Options which rely on interfaces only Linux has
+    die_on(cfg->watch, "--watch is only supported on Linux\n");
+    die_on(cfg->isolate, "--isolate is only supported on Linux\n");
+#endif
+
+    if (optind != argc - 1)
+        usage(argv[0]);
+    cfg->pdf_file = argv[optind];
+}
+
+// Entry point for render processes, see farm_spawn(). uri is "-" if the PDF is
+// at FARM_DOC_FD.
+static int render_process_main(const char *uri) {
+    GBytes *bytes = NULL;
+    if (strcmp(uri, "-") == 0) {
+        struct stat st;
+        expect(fstat(FARM_DOC_FD, &st) == 0);
+        void *addr =
+            mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, FARM_DOC_FD, 0);
+        expect(addr != MAP_FAILED);
+        bytes = g_bytes_new_static(addr, st.st_size);
     }
+    PopplerDocument *document = load_document(uri, bytes);
+
+    for (;;) {
+        struct bv_band band;
+        int fd;
+        ssize_t len = recv_with_fd(FARM_SOCK_FD, &band, sizeof(band), &fd);
+        if (len == 0)
+            return EXIT_SUCCESS;
+        expect(len == sizeof(band) && fd >= 0);
+
+        size_t size = (size_t)band.stride * band.height;
+        void *addr =
+            mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        expect(addr != MAP_FAILED);
+        cairo_surface_t *surface = cairo_image_surface_create_for_data(
+            addr, CAIRO_FORMAT_ARGB32, band.width, band.height, band.stride);
+        render_band(document, surface, &band);
+        cairo_surface_destroy(surface);
+        munmap(addr, size);
 
-    if (strcmp(argv[1], "-h") == 0 || strcmp(argv[1], "--help") == 0) {
-        execlp("man", "man", "1", "beamview", NULL);
-        perror("execlp man");
-        return EXIT_FAILURE;
+        int status = 0;
+        expect(send(FARM_SOCK_FD, &status, sizeof(status), MSG_NOSIGNAL) ==
+               sizeof(status));
     }
+}
+
+int main(int argc, char *argv[]) {
+    if (argc == 3 && strcmp(argv[1], "--render-worker") == 0)
+        return render_process_main(argv[2]);
+
+    struct bv_config cfg;
+    parse_args(argc, argv, &cfg);
+    init_simd();
+
+    // Must be blocked before SDL or the pool start any threads, so that
+    // they all inherit it
+    static sigset_t report_signals;
+    sigemptyset(&report_signals);
+    sigaddset(&report_signals, SIGUSR1);
+    if (cfg.bench)
+        setenv("SDL_VIDEODRIVER", "dummy", 0);
+    else
+        expect(pthread_sigmask(SIG_BLOCK, &report_signals, NULL) == 0);
 
     SDL_SetHint(SDL_HINT_RENDER_SCALE_QUALITY, "2");
     expect(SDL_Init(SDL_INIT_VIDEO) == 0);
+    render_done_event = SDL_RegisterEvents(4);
+    expect(render_done_event != (Uint32)-1);
+    latency_report_event = render_done_event + 1;
+    reload_event = render_done_event + 2;
+    dedup_event = render_done_event + 3;
+
+    if (cfg.bench) {
+        run_bench(&cfg);
+        return EXIT_SUCCESS;
+    }
+
+    SDL_Thread *signal_thread = SDL_CreateThread(
+        latency_signal_thread, "bv_signals", &report_signals);
+    expect(signal_thread);
+    SDL_DetachThread(signal_thread);
 
     struct bv_prog_state ps;
-    init_prog_state(&ps, argv[1]);
+    init_prog_state(&ps, &cfg);
     handle_sdl_events(&ps);
     free_prog_state(&ps);
 }